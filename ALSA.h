@@ -6,7 +6,9 @@
 #include <iomanip>
 #include <thread>
 #include <atomic>
-#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdio>
 
 // External Libraries
 #include <alsa/asoundlib.h>
@@ -15,124 +17,229 @@
 #include "PARAMS.h"
 #include "Structs.h"
 #include "Timer.h"
+#include "Geometry.h"
+#include "Realtime.h"
+#include "RingBuffer.h"
+#include "Convert.h"
 
 using namespace std;
 
 //=====================================================================================
 
+// ALSA name of each sample_format
+const snd_pcm_format_t ALSA_FORMATS[NUM_SAMPLE_FORMATS] =
+{
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+    SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S24_3LE,
+    SND_PCM_FORMAT_S16_LE
+};
+
+// Snapshot of the capture health, see ALSA::getStats
+struct capture_stats
+{
+    uint64_t blocks;          // Blocks published to the ring
+    uint64_t xruns;           // Overruns reported by the device (-EPIPE)
+    uint64_t short_reads;     // Reads that returned fewer frames than a block (the block is dropped)
+    uint64_t errors;          // Other read errors
+    uint64_t recoveries;      // Times the stream was restarted
+    uint64_t dropped;         // Periods dropped because the main loop still held their ring block
+    double last_recovery_ms;  // Time the last restart took
+    double total_recovery_ms; // Time without capture since start
+    double latency_ms;        // Age of the first frame of the newest block when it reached the ring
+    double max_latency_ms;    // Highest latency since start
+    int queued_frames;        // Frames waiting in the ALSA buffer after the last read
+    bool running;             // False while the device is lost and being reopened
+    int period_frames;        // Period the device settled on
+    int buffer_frames;        // ALSA buffer the device settled on
+    unsigned int rate;        // Sample rate the device settled on
+};
+
+// One line for the UI, or every counter for the log
+string describeCapture(const capture_stats& stats, const bool detailed)
+{
+    char text[320];
+
+    if (!detailed)
+    {
+        if (!stats.running)
+        {
+            return "lost";
+        }
+        snprintf(text, sizeof(text), "%.0f ms, %llu xr", stats.latency_ms, static_cast<unsigned long long>(stats.xruns + stats.errors));
+        return text;
+    }
+
+    snprintf(text, sizeof(text), "%llu blocks, %llu xruns, %llu short, %llu errors, %llu dropped, %llu restarts (last %.1f ms, total %.1f ms), latency %.1f ms (max %.1f ms, %d queued), period %d of %d frames",
+             static_cast<unsigned long long>(stats.blocks), static_cast<unsigned long long>(stats.xruns),
+             static_cast<unsigned long long>(stats.short_reads), static_cast<unsigned long long>(stats.errors),
+             static_cast<unsigned long long>(stats.dropped), static_cast<unsigned long long>(stats.recoveries),
+             stats.last_recovery_ms, stats.total_recovery_ms, stats.latency_ms, stats.max_latency_ms, stats.queued_frames,
+             stats.period_frames, stats.buffer_frames);
+    return text;
+} // end describeCapture
+
 class ALSA
 {
 public:
-    // Initialize ALSA class
-    ALSA(const char* device_name, int m_channels, int n_channels, 
+    // Initialize ALSA class, ring blocks of num_frames follow the layout of the geometry
+    ALSA(const char* device_name, const geometry& mics,
+         int sample_rate, int num_frames);
+
+    // Raw capture of channels hardware channels as one row in hardware order (a device of an aggregate)
+    ALSA(const char* device_name, const int channels,
          int sample_rate, int num_frames);
 
     // Clear memory for all arrays
     ~ALSA();
 
-    // Send settings to audio device
+    // Send settings to audio device, the period and buffer are negotiated (see getStats)
     bool setup();
 
+    // Starts and stops this device together with other, after both are set up; false if the driver can not link them
+    bool link(ALSA& other);
+
     // Starts recording audio
     void start();
 
     // Stops recording audio
     void stop();
 
-    // Access ring buffer
-    void copyRingBuffer(array3D<float>& data_output_1, array3D<float>& data_output_2);
+    // Captured blocks of num_frames (the main loop is the only consumer)
+    audio_ring& getRing();
+
+    // Capture counters and latency, safe to call from any thread at any time (no lock)
+    capture_stats getStats();
+
+    // One line for the UI, or every counter for the log
+    string describeStats(const bool detailed);
 
-    atomic<int> pcm_error = 0;     // Flag for buffer error
+    atomic<int> pcm_error = 0;     // Flag for the error window, set while the device is lost (2)
     atomic<int> frame_counter = 0; // Counter for frames recorded
 
 
 private:
+    // rows x columns ring blocks of channels hardware channels, in hardware order until remapped
+    ALSA(const char* device_name, const int rows, const int columns, const int channels,
+         int sample_rate, int num_frames);
+
     // Records audio from device
     bool recordAudio();
 
+    // Reads one block with snd_pcm_readi into data_buffer and converts it into block (nullptr drops it), returns frames or an error code
+    snd_pcm_sframes_t readPeriod(float* block);
+
+    // Converts one block straight out of the mmap area into block (nullptr drops it), returns frames or an error code
+    snd_pcm_sframes_t readPeriodMMAP(float* block);
+
+    // Restarts the stream after a read error: snd_pcm_recover, then drop and prepare, then reopen until the device is back
+    void recover(const int error);
+
+    // Capture time of the first frame of the block just read, from the hardware timestamp if the driver has one
+    int64_t periodStart(snd_pcm_status_t* status, const int64_t read_time);
+
     // Configs
     snd_pcm_stream_t stream = SND_PCM_STREAM_CAPTURE;        // Set the pcm stream to capture
-    snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED; // Stores data where ch1[0], ch2[0], ...ch16[0], ch1[1],...
-    snd_pcm_format_t format = SND_PCM_FORMAT_S32_LE;         // Format for input data (32-bit little endian)
+    snd_pcm_access_t access = SND_PCM_ACCESS_MMAP_INTERLEAVED; // Stores data where ch1[0], ch2[0], ...ch16[0], ch1[1],... (RW_INTERLEAVED if the device has no mmap)
+    sample_format format = CAPTURE_FORMAT;                   // Format for input data, negotiated in setup
     int mode = 0;        // Mode for pcm (0 is default)
-    int periods = 2;     // Number of periods. For scheduling interrupts
-    int num_bytes = 4;   // Number of bytes read per sample
-    int COLS = M_AMOUNT; // Number of columns
-    int ROWS = N_AMOUNT; // Number of rows
 
     // Variables
-    snd_pcm_t *pcm_handle;          // pcm handle
+    snd_pcm_t *pcm_handle = nullptr; // pcm handle
     snd_pcm_hw_params_t *hw_params; // Contains information about pcm configs
     const char *pcm_name;           // Name of pcm device (ie. hw:0,0)
     unsigned int exact_rate;        // Sample rate returned by snd_pcm_hw_params_rate_near
     int dir;                        // Checks if rate and exact_rate are the same
-    int num_channels;               // Total number of channels
+    int num_channels;               // Hardware channels captured (interleaved)
     int rate;                       // Defined sample rate
-    snd_pcm_uframes_t frames;       // Number of frames recorded per period
-    int frame_size;                 // Size of one frame
-    snd_pcm_uframes_t buffer_size;  // Size of buffer (BUFFER_SIZE * NUM_BYTES * NUM_CHANNELS)
-    int32_t* data_buffer;           // Buffer for interlaced data to be written to
+    snd_pcm_uframes_t frames;       // Frames per read and ring block
+    int frame_size;                 // Samples in one block (frames * num_channels)
+    snd_pcm_uframes_t period_frames; // Period size, negotiated near frames
+    snd_pcm_uframes_t buffer_frames; // ALSA buffer size, negotiated near CAPTURE_PERIODS periods or blocks
+    uint8_t* data_buffer;           // Buffer for interlaced data to be written to (frame_size samples of up to 4 bytes)
+    convert_kernel convert;         // Interleaved samples of format to channel planar floats
     int pcm_return;                 // Return value for pcm reading (for error handling)
     array2D<int> channel_order;     // Physical channels may not be in correct order
 
-    array3D<float> data_buffer_1;   // Buffer for audio data
-    array3D<float> data_buffer_2;   // Buffer for audio data
+    audio_ring ring;                // Channel planar blocks for the beamformer
 
     thread recording_thread;        // Thread for recording audio
     atomic<bool> is_recording;      // Flag for recording status
-    mutex buffer_mutex;             // Mutex for buffer access
 
     timer ALSA_timer;              // Timer for debugging
 
+    // Stats, written by the recording thread only
+    atomic<uint64_t> stat_xruns{0};
+    atomic<uint64_t> stat_short_reads{0};
+    atomic<uint64_t> stat_errors{0};
+    atomic<uint64_t> stat_recoveries{0};
+    atomic<int64_t> stat_last_recovery{0};  // ns
+    atomic<int64_t> stat_total_recovery{0}; // ns
+    atomic<int64_t> stat_latency{0};        // ns
+    atomic<int64_t> stat_max_latency{0};    // ns
+    atomic<int> stat_queued{0};
+    atomic<bool> stat_running{false};
+    atomic<int> stat_period{0};
+    atomic<int> stat_buffer{0};
+    atomic<unsigned int> stat_rate{0};
+
 }; // end class def
 
 //=====================================================================================
 
-ALSA::ALSA(const char* device_name, int m_channels, int n_channels, int sample_rate, int num_frames):
+ALSA::ALSA(const char* device_name, const int rows, const int columns, const int channels, int sample_rate, int num_frames):
     pcm_name(device_name),
-    num_channels(m_channels * n_channels),
+    num_channels(channels),
     rate(sample_rate),
     frames(num_frames),
-    frame_size(m_channels * n_channels * num_frames),
-    buffer_size(frames * num_channels),
-    channel_order(m_channels, n_channels),
+    frame_size(channels * num_frames),
+    period_frames(num_frames),
+    buffer_frames(num_frames * CAPTURE_PERIODS),
+    channel_order(rows, columns),
 
-    data_buffer_1(m_channels, n_channels, num_frames),
-    data_buffer_2(m_channels, n_channels, num_frames),
+    ring(ringBlocks(num_frames, sample_rate), rows, columns, num_frames),
 
     ALSA_timer("ALSA")
 
     {
         // Allocate memory for dataBuffer
-        data_buffer = new int32_t[buffer_size]; 
+        data_buffer = new uint8_t[frame_size * 4];
+        convert = convertKernel(format);
 
-        // Map channel order
+        // Hardware order
         for (int m = 0; m < channel_order.dim_1; m++)
         {
             for (int n = 0; n < channel_order.dim_2; n++)
             {
-                channel_order.at(m, n) = CHANNEL_ORDER[m][n];
+                channel_order.at(m, n) = m * columns + n;
             }
         }
+    } // end ALSA
 
-        // Clear buffers
-        for (int m = 0; m < data_buffer_1.dim_1; m++)
+ALSA::ALSA(const char* device_name, const geometry& mics, int sample_rate, int num_frames):
+    ALSA(device_name, mics.getRows(), mics.getColumns(), mics.hardwareChannels(), sample_rate, num_frames)
+    {
+        // Map channel order
+        for (int m = 0; m < channel_order.dim_1; m++)
         {
-            for (int n = 0; n < data_buffer_1.dim_2; n++)
+            for (int n = 0; n < channel_order.dim_2; n++)
             {
-                for (int b = 0; b < data_buffer_1.dim_3; b++)
-                {
-                    data_buffer_1.at(m, n, b) = 0.0f;
-                    data_buffer_2.at(m, n, b) = 0.0f;
-                } // end b
-            } // end n
-        } // end m
+                channel_order.at(m, n) = mics.at(m, n).channel;
+            }
+        }
+    } // end ALSA
+
+ALSA::ALSA(const char* device_name, const int channels, int sample_rate, int num_frames):
+    ALSA(device_name, 1, channels, channels, sample_rate, num_frames)
+    {
     } // end ALSA
 
 //=====================================================================================
 
 ALSA::~ALSA()
 {
+    stop();
     delete[] data_buffer;
 } // end ~ALSA
 
@@ -146,6 +253,7 @@ bool ALSA::setup()
     // Open pcm
     if (snd_pcm_open(&pcm_handle, pcm_name, stream, mode) < 0)
     {
+        pcm_handle = nullptr;
         cerr << "Error opening PCM device." << endl;
         return false;
     }
@@ -157,19 +265,34 @@ bool ALSA::setup()
         return false;
     }
 
-    // Set access type
+    // Set access type, reading the DMA area directly if the device can map it
+    if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED && snd_pcm_hw_params_test_access(pcm_handle, hw_params, access) < 0)
+    {
+        cerr << "PCM device has no mmap access, using snd_pcm_readi.\n";
+        access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    }
     if (snd_pcm_hw_params_set_access(pcm_handle, hw_params, access) < 0)
     {
         cerr << "Error setting access.\n";
         return false;
     }
 
-    // Set sample format
-    if (snd_pcm_hw_params_set_format(pcm_handle, hw_params, format) < 0)
+    // Set sample format, CAPTURE_FORMAT if the device has it, otherwise the best one it has
+    format = NUM_SAMPLE_FORMATS;
+    for (int i = -1; i < NUM_SAMPLE_FORMATS && format == NUM_SAMPLE_FORMATS; i++)
+    {
+        sample_format candidate = (i < 0) ? CAPTURE_FORMAT : static_cast<sample_format>(i);
+        if (snd_pcm_hw_params_test_format(pcm_handle, hw_params, ALSA_FORMATS[candidate]) == 0)
+        {
+            format = candidate;
+        }
+    } // end i
+    if (format == NUM_SAMPLE_FORMATS || snd_pcm_hw_params_set_format(pcm_handle, hw_params, ALSA_FORMATS[format]) < 0)
     {
-        cerr << "Error setting format.\n";
+        cerr << "Error setting format, the device has none of S32, FLOAT, S24, S24_3LE or S16.\n";
         return false;
     }
+    convert = convertKernel(format);
 
     // Set sample rate
     exact_rate = rate;
@@ -192,15 +315,17 @@ bool ALSA::setup()
         return 0;
     }
 
-    // Set number of periods
-    if (snd_pcm_hw_params_set_periods(pcm_handle, hw_params, periods, 0) < 0)
+    // Period near one block, so every block is one interrupt; the device rounds to what it supports
+    period_frames = frames;
+    if (snd_pcm_hw_params_set_period_size_near(pcm_handle, hw_params, &period_frames, &dir) < 0)
     {
-        cerr << "Error setting periods.\n";
+        cerr << "Error setting period size.\n";
         return false;
     }
 
-    // Set buffer size
-    if (snd_pcm_hw_params_set_buffer_size(pcm_handle, hw_params, buffer_size) < 0)
+    // Buffer in frames (not samples), CAPTURE_PERIODS periods (or blocks, if the period came out shorter) of headroom
+    buffer_frames = max(period_frames, frames) * CAPTURE_PERIODS;
+    if (snd_pcm_hw_params_set_buffer_size_near(pcm_handle, hw_params, &buffer_frames) < 0)
     {
         cerr << "Error setting buffer size.\n";
         return false;
@@ -212,9 +337,47 @@ bool ALSA::setup()
         return false;
     }
 
-    // snd_pcm_hw_params_get_format(hw_params, &format);
-    // cout << "PCM Format: " << snd_pcm_format_name(format) << endl;
+    // What the device settled on
+    snd_pcm_hw_params_get_period_size(hw_params, &period_frames, &dir);
+    snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_frames);
+    if (buffer_frames < frames)
+    {
+        cerr << "ALSA buffer of " << buffer_frames << " frames can not hold a block of " << frames << " frames.\n";
+        return false;
+    }
+    if (buffer_frames < 2 * frames)
+    {
+        cerr << "ALSA buffer of " << buffer_frames << " frames leaves no headroom for blocks of " << frames << " frames, expect overruns.\n";
+    }
+    stat_period.store(period_frames, memory_order_relaxed);
+    stat_buffer.store(buffer_frames, memory_order_relaxed);
+    stat_rate.store(exact_rate, memory_order_relaxed);
+
+    // Wake the capture thread once a whole block is in
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_sw_params_alloca(&sw_params);
+    if (snd_pcm_sw_params_current(pcm_handle, sw_params) < 0 ||
+        snd_pcm_sw_params_set_avail_min(pcm_handle, sw_params, frames) < 0)
+    {
+        cerr << "Error setting software parameters.\n";
+        return false;
+    }
 
+    // Timestamp hardware pointer updates on the monotonic clock (latency and block timestamps)
+    if (snd_pcm_sw_params_set_tstamp_mode(pcm_handle, sw_params, SND_PCM_TSTAMP_ENABLE) < 0 ||
+        snd_pcm_sw_params_set_tstamp_type(pcm_handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0)
+    {
+        cerr << "No PCM timestamps, latency is measured from the read time.\n";
+    }
+
+    if (snd_pcm_sw_params(pcm_handle, sw_params) < 0)
+    {
+        cerr << "Error setting software parameters.\n";
+        return false;
+    }
+
+    cout << "Capture " << pcm_name << ": " << snd_pcm_format_name(ALSA_FORMATS[format]) << ", " << exact_rate << " Hz, period " << period_frames << " frames (" << fixed << setprecision(1) << 1000.0 * period_frames / exact_rate
+         << " ms), buffer " << buffer_frames << " frames (" << 1000.0 * buffer_frames / exact_rate << " ms), blocks of " << frames << " frames\n" << defaultfloat;
     cout << "Finished setting up Audio.\n"; // (debugging)
 
     return true;
@@ -222,71 +385,260 @@ bool ALSA::setup()
 
 //=====================================================================================
 
-// Data outputs to M * N * FFT_SIZE array
+/*
+    Each read of frames frames becomes one ring block of (m, n, frames). The loop never exits
+    on a device error: an overrun or a failed read restarts the stream (see recover), the block is
+    lost and counted, and capture carries on. Only stop() ends it.
+*/
 bool ALSA::recordAudio()
 {
+    // Allocated once, alloca in the loop would grow the stack every period
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+
+    // Own CPU and FIFO priority, so UI, camera and disk load can not delay a period
+    #ifdef REALTIME_PROFILE
+    pinThread("capture", CAPTURE_CPU_MASK);
+    setRealtimePriority("capture", CAPTURE_PRIORITY);
+    prefaultStack();
+    #endif
+
+    stat_running = true;
     while (is_recording)
     {
-        // lock_guard<mutex> lock(buffer_mutex);
-        // Swap data from buffer_2 to buffer_1
-        swap(data_buffer_1.data, data_buffer_2.data);
+        // Device could not be opened by setup()
+        if (!pcm_handle)
+        {
+            recover(-ENODEV);
+            continue;
+        }
+
+        // Read data from microphones, remapped to not-interlaced floats and normalized (-1, 1), nothing is converted if the block is dropped
+        float *block = ring.writeBlock();
+        pcm_return = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) ? readPeriodMMAP(block) : readPeriod(block);
+        int64_t read_time = monotonicTime();
 
-        // Read data from microphones into interlaced buffer
-        pcm_return = snd_pcm_readi(pcm_handle, data_buffer, frames);
-    
         // Check for error
-        if (pcm_return == -EPIPE) 
-        { 
-            // Buffer overrun/underrun error
-            pcm_error = 1;
-            cerr << "Buffer overrun/underrun occurred. Recovering..." << endl;
-            snd_pcm_prepare(pcm_handle); // Prepare the device again
-            return false;
-        } 
-        else if (pcm_return < 0) 
+        if (pcm_return == -EPIPE)
         {
-            pcm_error = 2;
-            cerr << "Error reading PCM data: " << snd_strerror(pcm_return) << endl;
-            return false;
-        } 
-        else if (pcm_return != frames) 
+            // Buffer overrun, the device stopped when its buffer filled up
+            stat_xruns++;
+            recover(pcm_return);
+            continue;
+        }
+        else if (pcm_return < 0)
         {
-            pcm_error = 3;
-            cerr << "PCM read returned fewer frames than expected." << endl;
-            return false;
+            stat_errors++;
+            cerr << "Error reading PCM data: " << snd_strerror(pcm_return) << endl;
+            recover(pcm_return);
+            continue;
         }
-
-        else if (pcm_return == frames)
+        else if (pcm_return != frames)
         {
-            pcm_error = 0;
+            // Only part of a block, the stream itself is fine
+            stat_short_reads++;
+            continue;
         }
 
-        // Remap the data to not-interlaced floats and normalize (-1, 1)
-        for (int b = 0; b < frames; b++)
-        {
-            for (int n = 0; n < ROWS; n++)
-            {
-                for (int m = 0; m < COLS; m++)
-                {
-                    data_buffer_2.at(m, n, b) = static_cast<float>(data_buffer[b * num_channels + channel_order.at(m, n)]) / static_cast<float>(1 << 31);
-                } // end m
-            } // end n
-        } // end b
+        pcm_error = 0;
+
         // cout << "End recordAudio\n";
 
+        ring.commitBlock(periodStart(status, read_time));
+
         frame_counter++;
 
         // data_buffer_1.print_layer(100);
     } // end loop
 
+    stat_running = false;
+
     // cout << "Frames: " << frames << " --- pcm_return: " << pcm_return << "\n";
     return true;
 } // end recordAudio
 
 //=====================================================================================
 
+int64_t ALSA::periodStart(snd_pcm_status_t* status, const int64_t read_time)
+{
+    const int64_t period_time = static_cast<int64_t>(frames) * 1000000000LL / exact_rate;
+
+    // The read returns once the last frame is in, so without a timestamp the block started one block earlier
+    int64_t start = read_time - period_time;
+    int queued = 0;
+
+    // Otherwise: the hardware pointer was queued frames past the end of this block at the timestamp
+    if (snd_pcm_status(pcm_handle, status) == 0)
+    {
+        snd_htimestamp_t stamp;
+        snd_pcm_status_get_htstamp(status, &stamp);
+        queued = max<snd_pcm_sframes_t>(snd_pcm_status_get_delay(status), 0);
+        if (stamp.tv_sec != 0 || stamp.tv_nsec != 0)
+        {
+            const int64_t stamp_time = static_cast<int64_t>(stamp.tv_sec) * 1000000000LL + stamp.tv_nsec;
+            start = stamp_time - static_cast<int64_t>(queued + frames) * 1000000000LL / exact_rate;
+        }
+    }
+
+    const int64_t latency = read_time - start;
+    stat_latency.store(latency, memory_order_relaxed);
+    stat_max_latency.store(max(latency, stat_max_latency.load(memory_order_relaxed)), memory_order_relaxed);
+    stat_queued.store(queued, memory_order_relaxed);
+    return start;
+} // end periodStart
+
+//=====================================================================================
+
+void ALSA::recover(const int error)
+{
+    const int64_t start = monotonicTime();
+
+    // Prepares after an overrun, resumes after a suspend
+    int result = pcm_handle ? snd_pcm_recover(pcm_handle, error, 1) : -ENODEV;
+
+    // Anything else: stop the stream and prepare it again
+    if (result < 0 && pcm_handle)
+    {
+        snd_pcm_drop(pcm_handle);
+        result = snd_pcm_prepare(pcm_handle);
+    }
+
+    // Device is gone (unplugged, driver reset): reopen it until it is back or capture is stopped
+    while (result < 0 && is_recording)
+    {
+        pcm_error = 2;
+        stat_running = false;
+        cerr << "Capture device lost (" << snd_strerror(result) << "), reopening.\n";
+        this_thread::sleep_for(chrono::milliseconds(CAPTURE_RETRY_MS));
+
+        if (pcm_handle)
+        {
+            snd_pcm_close(pcm_handle);
+            pcm_handle = nullptr;
+        }
+        result = setup() ? 0 : -ENODEV;
+    } // end retry
+    stat_running = true;
+
+    // The stream restarts on the next read (snd_pcm_readi starts it, readPeriodMMAP calls snd_pcm_start)
+    const int64_t duration = monotonicTime() - start;
+    stat_recoveries++;
+    stat_last_recovery.store(duration, memory_order_relaxed);
+    stat_total_recovery.fetch_add(duration, memory_order_relaxed);
+} // end recover
+
+//=====================================================================================
+
+snd_pcm_sframes_t ALSA::readPeriod(float* block)
+{
+    snd_pcm_sframes_t result = snd_pcm_readi(pcm_handle, data_buffer, frames);
+    if (result == static_cast<snd_pcm_sframes_t>(frames) && block)
+    {
+        // channel_order is (m, n) row major, the order of the block channels
+        convert(data_buffer, num_channels, frames, channel_order.data, channel_order.dim_1 * channel_order.dim_2, block, frames);
+    }
+    return result;
+} // end readPeriod
+
+//=====================================================================================
+
+/*
+    The block is converted where the hardware put it, skipping the copy snd_pcm_readi does
+    into data_buffer. mmap_begin hands out frames up to the end of the ALSA buffer, so a
+    block that wraps comes in two chunks.
+*/
+snd_pcm_sframes_t ALSA::readPeriodMMAP(float* block)
+{
+    snd_pcm_uframes_t done = 0;
+    while (done < frames)
+    {
+        // A capture stream in mmap mode has to be started explicitly
+        if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED)
+        {
+            int error = snd_pcm_start(pcm_handle);
+            if (error < 0)
+            {
+                return error;
+            }
+        }
+
+        snd_pcm_sframes_t available = snd_pcm_avail_update(pcm_handle);
+        if (available < 0)
+        {
+            return available;
+        }
+        if (static_cast<snd_pcm_uframes_t>(available) < frames - done)
+        {
+            int error = snd_pcm_wait(pcm_handle, 1000);
+            if (error < 0)
+            {
+                return error;
+            }
+            if (error == 0)
+            {
+                return -EIO; // Timed out, the device stopped delivering
+            }
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t count = frames - done;
+        int error = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &count);
+        if (error < 0)
+        {
+            return error;
+        }
+
+        if (block)
+        {
+            // Interleaved: every channel area starts at the same frame, step is one frame in bits
+            const uint8_t *interleaved = static_cast<const uint8_t *>(areas[0].addr) + areas[0].first / 8 + offset * (areas[0].step / 8);
+            convert(interleaved, num_channels, count, channel_order.data, channel_order.dim_1 * channel_order.dim_2, block + done, frames);
+        }
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm_handle, offset, count);
+        if (committed < 0)
+        {
+            return committed;
+        }
+        if (static_cast<snd_pcm_uframes_t>(committed) != count)
+        {
+            return -EPIPE;
+        }
+        done += count;
+    } // end chunk
+
+    return done;
+} // end readPeriodMMAP
+
+//=====================================================================================
+
+bool ALSA::link(ALSA& other)
+{
+    if (!pcm_handle || !other.pcm_handle)
+    {
+        return false;
+    }
+
+    int error = snd_pcm_link(pcm_handle, other.pcm_handle);
+    if (error < 0)
+    {
+        cerr << "Could not link " << other.pcm_name << " to " << pcm_name << ": " << snd_strerror(error) << "\n";
+        return false;
+    }
+
+    return true;
+} // end link
+
+//=====================================================================================
+
 void ALSA::start()
 {
+    #ifdef REALTIME_PROFILE
+    ring.lock(); // Already locked if lockMemory() succeeded
+    #endif
+
     is_recording = true;
     recording_thread = thread(&ALSA::recordAudio, this);
 } // end start
@@ -304,23 +656,39 @@ void ALSA::stop()
 
 //=====================================================================================
 
-void ALSA::copyRingBuffer(array3D<float>& data_output_1, array3D<float>& data_output_2)
+capture_stats ALSA::getStats()
 {
-    // ALSA_timer.start();
+    capture_stats stats;
+    stats.blocks = ring.getWritten();
+    stats.xruns = stat_xruns.load(memory_order_relaxed);
+    stats.short_reads = stat_short_reads.load(memory_order_relaxed);
+    stats.errors = stat_errors.load(memory_order_relaxed);
+    stats.recoveries = stat_recoveries.load(memory_order_relaxed);
+    stats.dropped = ring.getOverruns();
+    stats.last_recovery_ms = stat_last_recovery.load(memory_order_relaxed) / 1e6;
+    stats.total_recovery_ms = stat_total_recovery.load(memory_order_relaxed) / 1e6;
+    stats.latency_ms = stat_latency.load(memory_order_relaxed) / 1e6;
+    stats.max_latency_ms = stat_max_latency.load(memory_order_relaxed) / 1e6;
+    stats.queued_frames = stat_queued.load(memory_order_relaxed);
+    stats.running = stat_running.load(memory_order_relaxed);
+    stats.period_frames = stat_period.load(memory_order_relaxed);
+    stats.buffer_frames = stat_buffer.load(memory_order_relaxed);
+    stats.rate = stat_rate.load(memory_order_relaxed);
+    return stats;
+} // end getStats
 
-    for (int m = 0; m < data_buffer_1.dim_1; m++)
-    {
-        for (int n = 0; n < data_buffer_1.dim_2; n++)
-        {
-            for (int b = 0; b < data_buffer_1.dim_3; b++)
-            {
-                data_output_1.at(m, n, b) = data_buffer_1.at(m, n, b);
-                data_output_2.at(m, n, b) = data_buffer_2.at(m, n, b);
-            } // end b
-        } // end n
-    } // end m 
-    // ALSA_timer.end();
-    // ALSA_timer.print();
-} // end copyRingBuffer
+//=====================================================================================
+
+string ALSA::describeStats(const bool detailed)
+{
+    return describeCapture(getStats(), detailed);
+} // end describeStats
+
+//=====================================================================================
+
+audio_ring& ALSA::getRing()
+{
+    return ring;
+} // end getRing
 
 #endif
\ No newline at end of file
@@ -0,0 +1,573 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+// Headers
+#include "PARAMS.h"
+#include "Geometry.h"
+#include "RingBuffer.h"
+#include "Realtime.h"
+#include "ALSA.h"
+
+using namespace std;
+
+const int AGGREGATE_VIEW_BLOCKS = 16; // Newest blocks of a device looked at per output block
+
+/*
+    Several capture interfaces as one array. Every device is an ALSA capture of its raw
+    channels into its own ring (with its own recovery and stats); the aggregate thread takes
+    the first device as the clock master and, for every master block, resamples the other
+    devices onto the master timeline and writes one (m, n, frames) block of the whole array
+    into the ring the beamformer reads. Hardware channels are numbered device after device:
+    mic channel c is channel c % AGGREGATE_DEVICE_CHANNELS of device c / AGGREGATE_DEVICE_CHANNELS.
+
+    Alignment: every block carries the capture time of its first frame from the hardware
+    timestamp (ALSA::periodStart). A delay-locked loop per device (as in JACK, F. Adriaensen,
+    "Using a DLL to filter time") filters those into a start time and a block duration, so
+    the device frame captured at the start of a master block follows from the two start times,
+    and device frames per master frame (the drift) from the two durations. The read position
+    of each device is resampled by linear interpolation at the drift, plus whatever slews the
+    remaining alignment error away over DRIFT_SLEW_BLOCKS; it only jumps after a restart.
+    Devices are linked with snd_pcm_link so they start together where the driver allows it
+    (a device reopened after a loss runs unlinked, its timestamps still align it).
+
+    Testing without the interfaces, with the ALSA loopback driver (one capture device per
+    substream, fed by what is played into the matching playback substream):
+        sudo modprobe snd-aloop pcm_substreams=4
+        AGGREGATE_DEVICE_NAMES "hw:Loopback,1,0 hw:Loopback,1,1 hw:Loopback,1,2 hw:Loopback,1,3"
+        speaker-test -D hw:Loopback,0,N -c 16 -r 48000 -F S32_LE -t sine -f 1000   (N = 0 to 3)
+    Substreams of one card share a clock, so the drift stays near 0 ppm and the tone lines up
+    across devices. The "PCM Rate Shift 100000" control of a substream (amixer -c Loopback
+    contents) skews its clock, 100010 is +100 ppm, which the drift in the log should follow.
+    snd-dummy (modprobe snd-dummy pcm_substreams=4 hrtimer=1) captures silence on a timer,
+    enough to test linking, restarts and block timing.
+*/
+class aggregate
+{
+public:
+    // Devices by name (space separated, empty for AUDIO_DEVICE_NAME), blocks of num_frames follow the layout of the geometry
+    aggregate(const char* device_names, const geometry& mics,
+              int sample_rate, int num_frames);
+
+    // Stops capture
+    ~aggregate();
+
+    // Sets up every device and links them to the first, false if one could not be set up (it keeps retrying once started)
+    bool setup();
+
+    // Starts recording audio
+    void start();
+
+    // Stops recording audio
+    void stop();
+
+    // Blocks of the whole array (the main loop is the only consumer)
+    audio_ring& getRing();
+
+    // Capture counters summed over the devices, latency of the combined blocks; safe from any thread
+    capture_stats getStats();
+
+    // One line for the UI, or every counter, the drift and the alignment of every device for the log
+    string describeStats(const bool detailed);
+
+    atomic<int> pcm_error = 0; // Worst flag of the devices
+
+private:
+    // One interface of the aggregate
+    struct device
+    {
+        string name;
+        unique_ptr<ALSA> capture;
+        vector<int> outputs; // Output channel (m * columns + n) of each mic on this device
+        vector<int> inputs;  // Device channel of each of those mics
+
+        // Clock filter, ns on the monotonic clock
+        bool locked = false;
+        uint64_t sequence = 0; // Block t0 belongs to
+        double t0 = 0.0;       // Filtered capture time of block sequence
+        double t1 = 0.0;       // Predicted capture time of block sequence + 1
+        double period = 0.0;   // Filtered block duration
+        int settling = 0;      // Blocks left at the wide bandwidth after locking
+
+        // Read position, in device frames since start (sequence * block_frames + offset)
+        bool aligned = false;
+        double position = 0.0; // At the start of the next output block
+
+        // For getStats, written by the aggregate thread only
+        atomic<double> drift_ppm{0.0};
+        atomic<double> align_error{0.0}; // Frames
+    };
+
+    // Combines the device blocks into ring until stop()
+    void combine();
+
+    // Feeds the start times of newly published blocks of a device into its clock filter
+    void updateClock(device& dev, const audio_view& view);
+
+    // Resamples the mics of a device for the output block starting at start (ns) into block (nullptr only advances),
+    // false if the device has not delivered those frames yet
+    bool resample(device& dev, const double start, float* block);
+
+    // Writes silence for the mics of a device
+    void silence(device& dev, float* block);
+
+    vector<unique_ptr<device>> devices; // [0] is the clock master
+    int rows;                           // Mic layout
+    int columns;
+    int block_frames;                   // Frames per block
+    int rate;                           // Nominal sample rate
+    double filter_b;                    // Clock filter gains (sqrt(2) w and w^2, w = 2 pi DRIFT_BANDWIDTH block time)
+    double filter_c;
+    double settle_b;                    // Same at DRIFT_SETTLE_FACTOR times the bandwidth, for the first second after locking
+    double settle_c;
+    int settle_blocks;                  // Blocks in that second
+
+    audio_ring ring;                    // Blocks of the whole array
+
+    vector<float> span;                 // Device frames of one channel being interpolated
+    vector<int> span_index;             // (frame) first span frame of each output frame
+    vector<float> span_fraction;        // (frame) interpolation weight of the next one
+
+    thread combine_thread;              // Aggregate thread
+    atomic<bool> is_running;
+
+    // Stats, written by the aggregate thread only
+    atomic<int64_t> stat_latency{0};     // ns
+    atomic<int64_t> stat_max_latency{0}; // ns
+    atomic<uint64_t> stat_realigned{0};  // Position jumps (restarts)
+    atomic<uint64_t> stat_late{0};       // Device blocks filled with silence
+    atomic<uint64_t> stat_skipped{0};    // Master blocks overwritten before they were combined
+
+}; // end class def
+
+//=====================================================================================
+
+aggregate::aggregate(const char* device_names, const geometry& mics, int sample_rate, int num_frames) : rows(mics.getRows()),
+                                                                                                        columns(mics.getColumns()),
+                                                                                                        block_frames(num_frames),
+                                                                                                        rate(sample_rate),
+                                                                                                        ring(ringBlocks(num_frames, sample_rate), mics.getRows(), mics.getColumns(), num_frames),
+                                                                                                        span(2 * num_frames + 4),
+                                                                                                        span_index(num_frames),
+                                                                                                        span_fraction(num_frames),
+                                                                                                        is_running(false)
+{
+    // Devices in order, AGGREGATE_DEVICE_CHANNELS each
+    istringstream names(device_names);
+    string name;
+    while (names >> name)
+    {
+        devices.push_back(make_unique<device>());
+        devices.back()->name = name;
+    } // end name
+    if (devices.empty())
+    {
+        devices.push_back(make_unique<device>());
+        devices.back()->name = AUDIO_DEVICE_NAME;
+    }
+    for (unique_ptr<device> &dev : devices)
+    {
+        dev->capture = make_unique<ALSA>(dev->name.c_str(), AGGREGATE_DEVICE_CHANNELS, sample_rate, num_frames);
+    } // end dev
+
+    // Mics to devices, a mic beyond the last device stays silent
+    for (int m = 0; m < rows; m++)
+    {
+        for (int n = 0; n < columns; n++)
+        {
+            const int channel = mics.at(m, n).channel;
+            const size_t index = channel / AGGREGATE_DEVICE_CHANNELS;
+            if (index >= devices.size())
+            {
+                cerr << "Mic (" << m << ", " << n << ") is on channel " << channel << ", beyond the " << devices.size() * AGGREGATE_DEVICE_CHANNELS << " channels of the aggregate.\n";
+                continue;
+            }
+            devices[index]->outputs.push_back(m * columns + n);
+            devices[index]->inputs.push_back(channel % AGGREGATE_DEVICE_CHANNELS);
+        } // end n
+    } // end m
+
+    const double omega = 2.0 * M_PI * DRIFT_BANDWIDTH * block_frames / rate;
+    filter_b = sqrt(2.0) * omega;
+    filter_c = omega * omega;
+    settle_b = filter_b * DRIFT_SETTLE_FACTOR;
+    settle_c = filter_c * DRIFT_SETTLE_FACTOR * DRIFT_SETTLE_FACTOR;
+    settle_blocks = rate / block_frames;
+}
+
+aggregate::~aggregate()
+{
+    stop();
+} // end ~aggregate
+
+//=====================================================================================
+
+bool aggregate::setup()
+{
+    bool ready = true;
+    for (unique_ptr<device> &dev : devices)
+    {
+        ready = dev->capture->setup() && ready;
+    } // end dev
+
+    // Start together where the drivers allow it, the timestamps align them either way
+    for (size_t d = 1; d < devices.size(); d++)
+    {
+        devices[0]->capture->link(*devices[d]->capture);
+    } // end d
+
+    return ready;
+} // end setup
+
+//=====================================================================================
+
+void aggregate::start()
+{
+    #ifdef REALTIME_PROFILE
+    ring.lock();
+    #endif
+
+    for (unique_ptr<device> &dev : devices)
+    {
+        dev->capture->start();
+    } // end dev
+
+    is_running = true;
+    combine_thread = thread(&aggregate::combine, this);
+} // end start
+
+//=====================================================================================
+
+void aggregate::stop()
+{
+    is_running = false;
+    if (combine_thread.joinable())
+    {
+        combine_thread.join();
+    }
+
+    for (unique_ptr<device> &dev : devices)
+    {
+        dev->capture->stop();
+    } // end dev
+} // end stop
+
+//=====================================================================================
+
+/*
+    One output block per master block, in order. The master's channels are copied as they
+    are; every other device is resampled for the same capture time, waiting for a device that
+    is behind the master. A device that has still not delivered AGGREGATE_MAX_WAIT_MS after
+    the block ended is silent for that block, so a lost interface does not stop the array.
+*/
+void aggregate::combine()
+{
+    // Same CPU as the device threads, one step below them so it never delays a read. Started from
+    // main after it pinned itself to DSP_CPU_MASK, so this moves it off the CPUs it inherited
+    #ifdef REALTIME_PROFILE
+    pinThread("aggregate", CAPTURE_CPU_MASK);
+    setRealtimePriority("aggregate", CAPTURE_PRIORITY - 1);
+    prefaultStack();
+    #endif
+
+    device &master = *devices[0];
+    const int64_t block_time = static_cast<int64_t>(block_frames) * 1000000000LL / rate;
+    uint64_t next = 0; // Master block to combine next
+
+    while (is_running)
+    {
+        int error = 0;
+        for (unique_ptr<device> &dev : devices)
+        {
+            error = max(error, dev->capture->pcm_error.load());
+        } // end dev
+        pcm_error = error;
+
+        audio_ring &master_ring = master.capture->getRing();
+        audio_view master_view;
+        if (master_ring.getWritten() <= next || !master_ring.acquire(AGGREGATE_VIEW_BLOCKS, master_view))
+        {
+            this_thread::sleep_for(chrono::nanoseconds(block_time / 4));
+            continue;
+        }
+        updateClock(master, master_view);
+
+        // Skip what was overwritten while this thread was held up
+        const uint64_t oldest = master_view.info(0).sequence;
+        if (next < oldest)
+        {
+            stat_skipped.fetch_add(oldest - next, memory_order_relaxed);
+            next = oldest;
+        }
+        const int index = next - oldest;
+        const double start = master.t0 + (static_cast<double>(next) - static_cast<double>(master.sequence)) * master.period;
+
+        float *block = ring.writeBlock();
+        if (block)
+        {
+            for (size_t i = 0; i < master.outputs.size(); i++)
+            {
+                memcpy(block + master.outputs[i] * block_frames, master_view.channel(index, 0, master.inputs[i]), block_frames * sizeof(float));
+            } // end i
+        }
+        master_ring.release();
+
+        for (size_t d = 1; d < devices.size(); d++)
+        {
+            device &dev = *devices[d];
+            while (!resample(dev, start, block))
+            {
+                if (!is_running || monotonicTime() > start + block_time + AGGREGATE_MAX_WAIT_MS * 1000000LL)
+                {
+                    silence(dev, block);
+                    dev.aligned = false;
+                    stat_late.fetch_add(1, memory_order_relaxed);
+                    break;
+                }
+                this_thread::sleep_for(chrono::nanoseconds(block_time / 4));
+            } // end wait
+        } // end d
+
+        ring.commitBlock(static_cast<int64_t>(start));
+        next++;
+
+        const int64_t latency = monotonicTime() - static_cast<int64_t>(start);
+        stat_latency.store(latency, memory_order_relaxed);
+        stat_max_latency.store(max(latency, stat_max_latency.load(memory_order_relaxed)), memory_order_relaxed);
+    } // end while
+} // end combine
+
+//=====================================================================================
+
+/*
+    Second order DLL on the block start times: t0 follows the timestamps with the jitter
+    filtered out and period settles on the true block duration of the device clock. Blocks
+    this thread did not see (it was held up) are stepped over; a timestamp more than half a
+    block off the prediction means the stream restarted, so the filter starts over there.
+    The first timestamps carry the start-up jitter, so for a second after locking the filter
+    runs wider to pull it out quickly.
+*/
+void aggregate::updateClock(device& dev, const audio_view& view)
+{
+    for (int b = 0; b < view.num_blocks; b++)
+    {
+        const block_info &info = view.info(b);
+        if (dev.locked && info.sequence <= dev.sequence)
+        {
+            continue;
+        }
+
+        const double time = static_cast<double>(info.timestamp);
+        if (!dev.locked)
+        {
+            dev.locked = true;
+            dev.period = static_cast<double>(block_frames) * 1e9 / rate;
+            dev.sequence = info.sequence;
+            dev.t0 = time;
+            dev.t1 = time + dev.period;
+            dev.settling = settle_blocks;
+            continue;
+        }
+
+        const double predicted = dev.t1 + static_cast<double>(info.sequence - dev.sequence - 1) * dev.period;
+        const double error = time - predicted;
+        dev.sequence = info.sequence;
+
+        if (fabs(error) > 0.5 * dev.period)
+        {
+            dev.t0 = time;
+            dev.t1 = time + dev.period;
+            dev.settling = settle_blocks;
+            dev.aligned = false;
+            stat_realigned.fetch_add(1, memory_order_relaxed);
+            continue;
+        }
+
+        const bool settling = dev.settling > 0;
+        dev.settling -= settling;
+        dev.t0 = predicted;
+        dev.t1 = predicted + (settling ? settle_b : filter_b) * error + dev.period;
+        dev.period += (settling ? settle_c : filter_c) * error;
+    } // end b
+} // end updateClock
+
+//=====================================================================================
+
+bool aggregate::resample(device& dev, const double start, float* block)
+{
+    audio_ring &dev_ring = dev.capture->getRing();
+    audio_view view;
+    if (!dev_ring.acquire(AGGREGATE_VIEW_BLOCKS, view))
+    {
+        return false;
+    }
+    updateClock(dev, view);
+
+    // Device frame captured at start, and device frames per master frame
+    const device &master = *devices[0];
+    const double target = (static_cast<double>(dev.sequence) + (start - dev.t0) / dev.period) * block_frames;
+    const double drift = master.period / dev.period;
+
+    double error = target - dev.position;
+    if (!dev.aligned || fabs(error) > ALIGN_RESET_FRAMES)
+    {
+        if (dev.aligned)
+        {
+            stat_realigned.fetch_add(1, memory_order_relaxed);
+        }
+        dev.position = target;
+        dev.aligned = true;
+        error = 0.0;
+    }
+    const double ratio = drift + error / (DRIFT_SLEW_BLOCKS * block_frames);
+    dev.drift_ppm.store((drift - 1.0) * 1e6, memory_order_relaxed);
+    dev.align_error.store(error, memory_order_relaxed);
+
+    // Device frames the block interpolates between, in the view
+    const int64_t first = static_cast<int64_t>(floor(dev.position));
+    const double offset = dev.position - first;
+    const int64_t last = first + static_cast<int64_t>(offset + (block_frames - 1) * ratio) + 1;
+    const uint64_t view_sequence = view.info(0).sequence;
+    const int64_t view_first = static_cast<int64_t>(view_sequence) * block_frames;
+    const int64_t view_end = view_first + static_cast<int64_t>(view.num_blocks) * block_frames;
+    if (last >= view_end)
+    {
+        dev_ring.release();
+        return false; // Not captured yet
+    }
+
+    if (first < view_first || last - first + 1 > static_cast<int64_t>(span.size()))
+    {
+        // Before the device started, or already gone (the master is far behind), start over from the target next block
+        silence(dev, block);
+        dev.aligned = false;
+        stat_late.fetch_add(1, memory_order_relaxed);
+    }
+    else if (block)
+    {
+        for (int k = 0; k < block_frames; k++)
+        {
+            const double position = offset + k * ratio;
+            span_index[k] = static_cast<int>(position);
+            span_fraction[k] = static_cast<float>(position - span_index[k]);
+        } // end k
+
+        for (size_t i = 0; i < dev.outputs.size(); i++)
+        {
+            // Frames first to last of the channel, across block boundaries
+            for (int64_t frame = first; frame <= last;)
+            {
+                const int64_t sequence = frame / block_frames;
+                const int within = frame - sequence * block_frames;
+                const int count = min<int64_t>(block_frames - within, last + 1 - frame);
+                memcpy(span.data() + (frame - first), view.channel(sequence - view_sequence, 0, dev.inputs[i]) + within, count * sizeof(float));
+                frame += count;
+            } // end frame
+
+            float *output = block + dev.outputs[i] * block_frames;
+            for (int k = 0; k < block_frames; k++)
+            {
+                const float a = span[span_index[k]];
+                const float b = span[span_index[k] + 1];
+                output[k] = a + span_fraction[k] * (b - a);
+            } // end k
+        } // end i
+    }
+
+    dev.position += block_frames * ratio;
+    dev_ring.release();
+    return true;
+} // end resample
+
+//=====================================================================================
+
+void aggregate::silence(device& dev, float* block)
+{
+    if (!block)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < dev.outputs.size(); i++)
+    {
+        memset(block + dev.outputs[i] * block_frames, 0, block_frames * sizeof(float));
+    } // end i
+} // end silence
+
+//=====================================================================================
+
+audio_ring& aggregate::getRing()
+{
+    return ring;
+} // end getRing
+
+//=====================================================================================
+
+capture_stats aggregate::getStats()
+{
+    // Negotiated settings and queue of the master
+    capture_stats stats = devices[0]->capture->getStats();
+    stats.dropped += stat_skipped.load(memory_order_relaxed);
+
+    for (size_t d = 1; d < devices.size(); d++)
+    {
+        capture_stats device_stats = devices[d]->capture->getStats();
+        stats.xruns += device_stats.xruns;
+        stats.short_reads += device_stats.short_reads;
+        stats.errors += device_stats.errors;
+        stats.recoveries += device_stats.recoveries;
+        stats.dropped += device_stats.dropped;
+        stats.last_recovery_ms = max(stats.last_recovery_ms, device_stats.last_recovery_ms);
+        stats.total_recovery_ms += device_stats.total_recovery_ms;
+        stats.running = stats.running && device_stats.running;
+    } // end d
+
+    stats.blocks = ring.getWritten();
+    stats.dropped += ring.getOverruns();
+    stats.latency_ms = stat_latency.load(memory_order_relaxed) / 1e6;
+    stats.max_latency_ms = stat_max_latency.load(memory_order_relaxed) / 1e6;
+    return stats;
+} // end getStats
+
+//=====================================================================================
+
+string aggregate::describeStats(const bool detailed)
+{
+    string text = describeCapture(getStats(), detailed);
+    if (!detailed)
+    {
+        return text;
+    }
+
+    char line[160];
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        if (d == 0)
+        {
+            snprintf(line, sizeof(line), "\n  %s: clock master", devices[d]->name.c_str());
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "\n  %s: drift %+.1f ppm, alignment %+.3f frames", devices[d]->name.c_str(),
+                     devices[d]->drift_ppm.load(memory_order_relaxed), devices[d]->align_error.load(memory_order_relaxed));
+        }
+        text += line;
+    } // end d
+
+    snprintf(line, sizeof(line), "\n  %llu realigned, %llu late device blocks",
+             static_cast<unsigned long long>(stat_realigned.load(memory_order_relaxed)),
+             static_cast<unsigned long long>(stat_late.load(memory_order_relaxed)));
+    return text + line;
+} // end describeStats
+
+//=====================================================================================
@@ -0,0 +1,184 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <vector>
+#include <cmath>
+
+// Headers
+#include "PARAMS.h"
+
+using namespace std;
+
+// One frequency band mapped onto FFT bins
+struct frequency_band
+{
+    float center_frequency; // Nominal center in Hz
+    float lower_frequency;  // Lower band edge in Hz
+    float upper_frequency;  // Upper band edge in Hz
+    int lower_bin;          // First bin overlapping the band
+    int upper_bin;          // Last bin overlapping the band
+    float lower_weight;     // Fraction of lower_bin inside the band
+    float upper_weight;     // Fraction of upper_bin inside the band
+};
+
+class bands
+{
+public:
+    // Constructor
+    bands(const int fft_size, const int sample_rate);
+
+    // Calculates bin ranges and edge weights for every band
+    void setup();
+
+    // Band from the FULL_OCTAVE_BANDS enum
+    const frequency_band &octave(const int band) const;
+
+    // Band from the THIRD_OCTAVE_BANDS enum
+    const frequency_band &third(const int band) const;
+
+    // FULL_RANGE_MIN to FULL_RANGE_MAX
+    const frequency_band &full() const;
+
+    // Band currently selected in the UI (full_range, octave_bands, octave_band_value, third_band_value)
+    const frequency_band &selected() const;
+
+private:
+    // Maps band edges in Hz onto bins, with the fraction of each edge bin inside the band
+    frequency_band makeBand(const float center_frequency, const float lower_frequency, const float upper_frequency);
+
+    int fft_size;    // Size of FFT in samples
+    int sample_rate; // Audio sample rate in Hz
+
+    vector<frequency_band> octave_table;       // (FULL_OCTAVE_BANDS)
+    vector<frequency_band> third_octave_table; // (THIRD_OCTAVE_BANDS)
+    frequency_band full_range_band;
+};
+
+bands::bands(const int fft_size, const int sample_rate) : fft_size(fft_size),
+                                                          sample_rate(sample_rate)
+{
+}
+
+//=====================================================================================
+
+/*
+    Band centers and edges follow IEC 61260-1 (base 10): G = 10^(3/10), exact center
+    f = 1000 * G^(x / b) and edges f * G^(-1 / 2b), f * G^(1 / 2b), with b = 1 for octaves
+    and b = 3 for third octaves. FULL_63 and THIRD_63 are x = -4 and x = -12.
+*/
+void bands::setup()
+{
+    const double G = pow(10.0, 0.3);
+
+    octave_table.clear();
+    for (int band = 0; band < NUM_FULL_OCTAVE_BANDS; band++)
+    {
+        double center = 1000.0 * pow(G, band - FULL_1000);
+        double edge = pow(G, 1.0 / 2.0);
+        octave_table.push_back(makeBand(center, center / edge, center * edge));
+    } // end band
+
+    third_octave_table.clear();
+    for (int band = 0; band < NUM_THIRD_OCTAVE_BANDS; band++)
+    {
+        double center = 1000.0 * pow(G, (band - THIRD_1000) / 3.0);
+        double edge = pow(G, 1.0 / 6.0);
+        third_octave_table.push_back(makeBand(center, center / edge, center * edge));
+    } // end band
+
+    full_range_band = makeBand(sqrtf(FULL_RANGE_MIN * FULL_RANGE_MAX), FULL_RANGE_MIN, FULL_RANGE_MAX);
+} // end setup
+
+//=====================================================================================
+
+/*
+    Bin k covers [(k - 0.5) * df, (k + 0.5) * df]. Every bin wholly inside the band gets weight 1,
+    the two edge bins get the fraction of their width that lies inside, so adjacent bands sum
+    to the full spectrum with no double counting. DC is never included.
+*/
+frequency_band bands::makeBand(const float center_frequency, const float lower_frequency, const float upper_frequency)
+{
+    const float bin_width = static_cast<float>(sample_rate) / fft_size;
+    const int max_bin = fft_size / 2;
+
+    frequency_band band;
+    band.center_frequency = center_frequency;
+    band.lower_frequency = lower_frequency;
+    band.upper_frequency = min(upper_frequency, 0.5f * sample_rate);
+
+    band.lower_bin = static_cast<int>(floorf(band.lower_frequency / bin_width + 0.5f));
+    band.upper_bin = static_cast<int>(floorf(band.upper_frequency / bin_width + 0.5f));
+    band.lower_bin = max(1, min(band.lower_bin, max_bin));
+    band.upper_bin = max(band.lower_bin, min(band.upper_bin, max_bin));
+
+    // Overlap of each edge bin with the band
+    float lower_bin_top = (band.lower_bin + 0.5f) * bin_width;
+    float upper_bin_bottom = (band.upper_bin - 0.5f) * bin_width;
+    if (band.lower_bin == band.upper_bin)
+    {
+        band.lower_weight = (band.upper_frequency - band.lower_frequency) / bin_width;
+        band.upper_weight = band.lower_weight;
+    }
+    else
+    {
+        band.lower_weight = (lower_bin_top - band.lower_frequency) / bin_width;
+        band.upper_weight = (band.upper_frequency - upper_bin_bottom) / bin_width;
+    }
+    band.lower_weight = max(0.0f, min(band.lower_weight, 1.0f));
+    band.upper_weight = max(0.0f, min(band.upper_weight, 1.0f));
+
+    return band;
+} // end makeBand
+
+//=====================================================================================
+
+const frequency_band &bands::octave(const int band) const
+{
+    if (band < 0 || band >= NUM_FULL_OCTAVE_BANDS)
+    {
+        cerr << "Invalid octave band: " << band << "\n";
+        return octave_table[max(0, min(band, NUM_FULL_OCTAVE_BANDS - 1))];
+    }
+
+    return octave_table[band];
+} // end octave
+
+//=====================================================================================
+
+const frequency_band &bands::third(const int band) const
+{
+    if (band < 0 || band >= NUM_THIRD_OCTAVE_BANDS)
+    {
+        cerr << "Invalid third octave band: " << band << "\n";
+        return third_octave_table[max(0, min(band, NUM_THIRD_OCTAVE_BANDS - 1))];
+    }
+
+    return third_octave_table[band];
+} // end third
+
+//=====================================================================================
+
+const frequency_band &bands::full() const
+{
+    return full_range_band;
+} // end full
+
+//=====================================================================================
+
+const frequency_band &bands::selected() const
+{
+    if (configs.b(full_range))
+    {
+        return full();
+    }
+
+    if (configs.b(octave_bands))
+    {
+        return octave(configs.i(octave_band_value));
+    }
+
+    return third(configs.i(third_band_value));
+} // end selected
+
+//=====================================================================================
@@ -3,16 +3,67 @@
 // Libraries
 #include <iostream>
 #include <complex>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include <cmath>              // for signbit
+#include <cstring>            // memcpy
+#include <fstream>            // Reading CPU name
+#include <sys/stat.h>         // mkdir for wisdom directory
 #include <fftw3.h>            // FFT
 #include <omp.h>              // Multithreading
 #include <opencv2/opencv.hpp> // OpenCV
 #include <stk/DelayL.h>       // STK Delay
 
+#if defined(__AVX2__)
+#include <immintrin.h>        // AVX2 intrinsics
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>         // NEON intrinsics
+#endif
+
 // Headers
 #include "PARAMS.h"
 #include "Structs.h"
 #include "Timer.h"
+#include "Bands.h"
+#include "CSM.h"
+#include "Geometry.h"
+#include "TableCache.h"
+#include "RingBuffer.h"
+
+// Everything a beamformer is built from, can be changed at runtime by building a new one
+struct beamform_params
+{
+    int fft_size;         // Size of FFT in samples
+    int sample_rate;      // Audio sample rate in Hz (has to match the capture)
+    int m_channels;       // Mics used along M, the first m_channels rows of the geometry layout
+    int n_channels;       // Mics used along N, the first n_channels columns of the geometry layout
+    int num_taps;         // Number of taps for FIR filter
+    geometry mics;        // Mic positions and hardware channels
+    float speed_of_sound; // Speed of sound in meters per second
+
+    int min_theta;  // Minimum theta angle in degrees
+    int max_theta;  // Maximum theta angle in degrees
+    int step_theta; // Step size for theta in degrees
+    int min_phi;    // Minimum phi angle in degrees
+    int max_phi;    // Maximum phi angle in degrees
+    int step_phi;   // Step size for phi in degrees
+
+    int numTheta() const {return (max_theta - min_theta) / step_theta + 1;}
+    int numPhi() const {return (max_phi - min_phi) / step_phi + 1;}
+
+    // Largest delay in samples over the grid and the mics used, after the offset by the smallest (as setupDelays)
+    float maxDelay() const;
+
+    // Checks ranges against the geometry layout and the delays against the FFT size, prints the first problem
+    bool valid() const;
+};
+
+// Parameters from the macros in PARAMS.h, using every mic of the geometry
+beamform_params defaultBeamformParams(const geometry &mics = geometry(M_AMOUNT, N_AMOUNT, MIC_SPACING));
+
+// Speed of sound in dry air in m/s at a temperature in degrees Celsius
+float speedOfSound(const float temperature);
 
 class beamform
 {
@@ -23,14 +74,56 @@ public:
              const int min_theta, const int max_theta, const int step_theta, const int num_theta,
              const int min_phi, const int max_phi, const int step_phi, const int num_phi);
 
+    // Constructor from a parameter set
+    beamform(const beamform_params &params);
+
     // Destructor
     ~beamform();
 
     // Sets up all constants and initialized FFT
     void setup();
 
-    // Performs beamforming
-    void processData(cv::Mat &data_output, const int lower_frequency, const int upper_frequency, const uint8_t post_process_type, array3D<float> &data_buffer_1, array3D<float> &data_buffer_2);
+    // Performs beamforming over one band (see Bands.h), data_output wraps the map without a copy and dies with the beamformer
+    void processData(cv::Mat &data_output, const frequency_band &band, const uint8_t post_process_type, const audio_view &audio);
+
+    // Performs beamforming over bins [lower_frequency, upper_frequency] with full weight on both edges
+    void processData(cv::Mat &data_output, const int lower_frequency, const int upper_frequency, const uint8_t post_process_type, const audio_view &audio);
+
+    // Performs beamforming once for every third octave band, data_output is (band, theta, phi) in dB
+    void processData(array3D<float> &data_output, const bands &band_table, const uint8_t post_process_type, const audio_view &audio);
+
+    // Selects delay-and-sum kernel (beamform_kernel enum)
+    void setKernel(const uint8_t kernel_type);
+
+    // Selects beamforming engine (beamform_engine enum), cheap to call every frame
+    void setEngine(const uint8_t engine_type);
+
+    // Sets number of worker threads (0 = all cores)
+    void setThreads(const int num_threads);
+
+    // Sets search quality (1 to 3, see BEAMFORM_QUALITY)
+    void setQuality(const int quality);
+
+    // Limits the bins integrated per band, keeping the center of the band (0 = all)
+    void setMaxBandBins(const int max_band_bins);
+
+    // Limits the Welch blocks added to the CSM per frame, keeping the newest (0 = all)
+    void setCSMBlocks(const int csm_blocks);
+
+    // Sets the speed of sound in m/s by rescaling the delay tables in place, cheap enough to call every frame
+    void setSpeedOfSound(const float speed_of_sound);
+
+    // Frames of audio processData reads from the view (two FFT windows)
+    int windowFrames() const;
+
+    // Time of the last processData call in ms
+    double getProcessTime();
+
+    // Time of the steering stage (delay-and-sum or steering by phase) of the last processData call in ms
+    double getSteeringTime();
+
+    // Parameters this beamformer was built from
+    const beamform_params &getParams() const;
 
 private:
     // Converts degrees to radians
@@ -39,31 +132,128 @@ private:
     // Calculates time delays
     void setupDelays();
 
+    // Splits delay_time into integer and fractional samples, checks they fit in one buffer
+    void splitDelays();
+
+    // Scales delay_time_base to the current speed of sound and rebuilds every table derived from it
+    void rescaleDelays();
+
+    // Hash of everything the delay and steering tables depend on
+    uint64_t tableKey();
+
+    // Calculates per-bin phase rotation for every direction and mic
+    void setupSteering();
+
+    // Calculates where every direction lands in the spatial FFT
+    void setupSpatialFFT();
+
+    // Groups directions by their delay along M for the separable engine
+    void setupSeparable();
+
     // Calculates FIR weights
     void setupFIR();
 
+    // Calculates the coarse grid lines of the hierarchical search
+    void setupHierarchy();
+
+    // Picks engine_type from requested_engine, falling back to the frequency domain engine where the array does not allow it
+    void applyEngine();
+
     // Creates FFT plan
     void setupFFT();
 
+    // Allocates FFT input, output and accumulators for every worker thread
+    void setupThreadBuffers();
+
+    // Wisdom file for this CPU, FFT size, batch and thread count
+    string wisdomFilename();
+
+    // Frees per-thread buffers
+    void freeThreadBuffers();
+
     // Access buffers at specified indicies
     float accessBuffer(const int m, const int n, const int b, array3D<float> &data_buffer_1, array3D<float> &data_buffer_2);
 
-    // Performs beamforming on audio data
-    void handleBeamforming(array3D<float> &data_buffer_1, array3D<float> &data_buffer_2);
+    // Copies the newest 2 * fft_size frames of the view into one contiguous window per channel
+    void loadWindow(const audio_view &audio);
+
+    // Blocks have to cover the array
+    bool checkBuffers(const audio_view &audio);
+
+    // Performs beamforming on the contiguous window with one shared STK delay line
+    void handleBeamformingSTK();
+
+    // Performs beamforming on the contiguous window with vectorised fractional delays
+    void handleBeamformingSIMD();
+
+    // output[b] += weight_0 * input[b] + weight_1 * input[b - 1] for b in [0, count)
+    void accumulateDelayed(float *output, const float *input, const float weight_0, const float weight_1, const int count);
+
+    // Performs FFT on the newest buffer of every mic, only keeping bins in [lower_bin, upper_bin]
+    void channelFFT(const int lower_bin, const int upper_bin);
+
+    // Single DFT bin of fft_size samples, unnormalized
+    complex<float> goertzel(const float *input, const int bin);
 
-    // Performs FFT on beamformed data
-    void FFT();
+    // Steers the mic spectra to every direction by phase, only for bins in [lower_bin, upper_bin]
+    void handleFrequencyDomain(const int lower_bin, const int upper_bin);
 
-    // Combines all bins and band passes data
-    void FFTCollapse(const int lower_frequency, const int upper_frequency);
+    // Computes the whole map per bin with one 2D spatial FFT, only for bins in [lower_bin, upper_bin]
+    void handleSpatialFFT(const int lower_bin, const int upper_bin);
 
-    // Performs designated post processing
-    void postProcess(const uint8_t post_process_type);
+    // Steers along M once per row delay, then along N per direction, only for bins in [lower_bin, upper_bin]
+    void handleSeparable(const int lower_bin, const int upper_bin);
+
+    // Performs FFT on beamformed data, only keeping bins in [lower_bin, upper_bin]
+    void FFT(const int lower_bin, const int upper_bin);
+
+    // FFTs every Welch block that ends inside the newest buffer and adds it to the CSM
+    void updateCSM();
+
+    // Evaluates w^H C w for every direction, only for bins in [lower_bin, upper_bin]
+    void handleCSM(const int lower_bin, const int upper_bin);
+
+    // Per-frame work of the selected engine that does not depend on direction (window, mic FFTs, CSM)
+    void handleChannels(const int lower_bin, const int upper_bin, const audio_view &audio);
+
+    // Per-direction work of the selected engine for every cell in active_cells
+    void handleDirections(const int lower_bin, const int upper_bin, const audio_view &audio);
+
+    // Coarse grid, then the neighbourhoods of the strongest peaks at finer strides, then fills the rest
+    void handleHierarchical(const frequency_band &band, const float band_scale, const uint8_t post_process_type, const audio_view &audio);
+
+    // Center max_band_bins of a band, band_scale is the full band width over the kept width
+    frequency_band limitBand(const frequency_band &band, float &band_scale);
+
+    // Strongest evaluated cells, at least min_distance cells apart
+    vector<int> findPeaks(const int num_peaks, const int min_distance);
+
+    // Interpolates every cell that was not evaluated from the nearest evaluated cells (dB, bilinear)
+    void fillUnevaluated();
+
+    // Marks every direction active
+    void setDenseGrid();
+
+    // Runs the selected engine, filling data_fft for bins in [lower_bin, upper_bin]
+    void handleSpectrum(const int lower_bin, const int upper_bin, const audio_view &audio);
+
+    // Combines the band's bins with its edge weights, applying post processing gains and band_scale, then converts to dB
+    void FFTCollapse(const frequency_band &band, const uint8_t post_process_type, const float band_scale = 1.0f);
+
+    // FFTCollapse for every third octave band in one pass over data_fft, into data_output (band, theta, phi)
+    void FFTCollapseCube(array3D<float> &data_output, const bands &band_table, const uint8_t post_process_type);
+
+    // Calculates per-bin linear power gain for every post processing type
+    void setupPostProcess();
+
+    // Linear power gain of a weighting curve (post_processing enum) at a frequency in Hz
+    float weightingGain(const uint8_t post_process_type, const float frequency);
 
     // Converts float2D to Mat
     cv::Mat array2DtoMat(const array2D<float> &data);
 
     // Initial conditions
+    beamform_params params; // Everything below as passed in
     int fft_size;     // Size of FFT in samples
     int sample_rate;  // Audio sample rate in Hz
     int m_channels;   // Number of microphones in the M direction
@@ -72,8 +262,11 @@ private:
     int num_taps;     // Number of taps for FIR filter
     int tap_offset;   // To center FIR filter around 0
 
-    float mic_spacing;    // Distance between microphones in meters
+    geometry mics;        // Mic positions, (m, n) is (row, column) of its layout
+    bool uniform_grid;    // Mics on a uniform planar grid (spatial FFT and separable engines)
+    bool delays_fit;      // Largest delay fits in one window (time domain engine)
     float speed_of_sound; // Speed of sound in meters per second
+    float base_speed_of_sound; // Speed of sound delay_time_base was built for
 
     int min_theta;  // Minimum theta angle in degrees
     int max_theta;  // Maximum theta angle in degrees
@@ -84,37 +277,188 @@ private:
     int step_phi;   // Step size for phi in degrees
     int num_phi;    // Total number of phi angles
 
+    uint8_t kernel_type; // Delay-and-sum kernel (beamform_kernel enum)
+    uint8_t engine_type;      // Beamforming engine in use (beamform_engine enum)
+    uint8_t requested_engine; // Engine from setEngine, engine_type falls back from it when the array does not allow it
+    int num_threads;     // Worker threads for theta/phi loops
+    int quality;         // Search quality (BEAMFORM_QUALITY)
+    int max_band_bins;   // Bins integrated per band (0 = all)
+    int csm_max_blocks;  // Welch blocks added per frame (0 = all)
+
+    // Directions evaluated by the engines
+    vector<int> active_cells;       // theta * num_phi + phi
+    array2D<uint8_t> cell_evaluated; // (theta, phi) 1 once a direction has a value this frame
+    vector<int> coarse_theta;       // Theta indices of the first pass
+    vector<int> coarse_phi;         // Phi indices of the first pass
+
     // Plan for fft to reuse
-    fftwf_plan fft_plan;
+    fftwf_plan fft_plan = nullptr;             // One direction (used with per-thread buffers)
+    fftwf_plan fft_batch_plan = nullptr;       // Every direction straight from data_beamform rows
+    fftwf_complex *data_spectrum = nullptr;    // (theta, phi, b / 2 + 1) batched FFT output
+
+    // Spatial FFT
+    int spatial_size;              // Zero-padded size per side
+    fftwf_plan spatial_plan = nullptr;       // In-place 2D FFT over (m, n)
+    fftwf_complex *spatial_buffer = nullptr; // (spatial_size, spatial_size)
+    array2D<float> spatial_power;  // (spatial_size, spatial_size)
+    array2D<float> spatial_m_step; // (theta, phi) spatial FFT row per bin
+    array2D<float> spatial_n_step; // (theta, phi) spatial FFT column per bin
+
+    // Separable steering
+    vector<float> separable_m_delay;           // (row delay) delay between neighbouring mics along M in samples
+    array2D<int> separable_row;                // (theta, phi) index into separable_m_delay
+    array2D<float> separable_n_delay;          // (theta, phi) delay between neighbouring mics along N in samples
+    vector<complex<float>> separable_partial;  // (row delay, n) partial beams for one bin
+
+    // Cross-spectral matrix
+    csm cross_spectra;                      // Averaged CSM for every bin
+    array2D<complex<float>> csm_snapshot;   // (channel, b / 2 + 1) spectra of one Welch block
+    int csm_hop;                            // Samples between Welch blocks
+    int csm_next_start;                     // Start of the next Welch block in data_window
+    int window_advance;                     // Samples data_window moved on the last loadWindow
+    int window_contiguous;                  // Audio in data_window is contiguous from here on, silence before it
+    int64_t window_sequence;                // Newest block in data_window, -1 before the first
 
     // Timers for profiling
     timer beamform_time;
     timer fft_time;
     timer fft_collapse_time;
-    timer post_process_time;
+    timer process_time;
 
     // Arrays
-    // array4D<int> delay_time_int;      // (theta, phi, m, n)
-    // array4D<float> delay_time_frac;   // (theta, phi, m, n)
+    array4D<int> delay_time_int;      // (theta, phi, m, n)
+    array4D<float> delay_time_frac;   // (theta, phi, m, n)
     array4D<float> delay_time;    // (theta, phi, m, n)
+    array4D<float> delay_time_base; // (theta, phi, m, n) delay_time at base_speed_of_sound, every rescale starts from it
+    array4D<complex<float>> steering_step; // (theta, phi, m, n) phase rotation from one bin to the next
     // array5D<float> FIR_weights;   // (theta, phi, m, n, num_taps)
-    float hamming_weights[FFT_SIZE]; // Hamming window weights
+    vector<float> hamming_weights; // (b) Hamming window weights
+    array3D<float> data_window;   // (m, n, 2 * b) newest audio, previous window followed by the current one
     array3D<float> data_beamform; // (theta, phi, b)
     // array3D<complex<float>> data_fft; // (theta, phi, b / 2 + 1)
-    float *fft_input_buffer;          // 1D buffer for input
-    fftwf_complex *fft_output_buffer; // 1D buffer for output
-    array3D<float> data_fft;          // (theta, phi, b / 2 + 1)
-    array2D<float> data_fft_collapse; // (theta, phi)
-    array2D<float> data_post_process; // (theta, phi)
+    float *fft_input_buffer = nullptr;          // 1D buffer for input (plan layout)
+    fftwf_complex *fft_output_buffer = nullptr; // 1D buffer for output (plan layout)
+    vector<float *> thread_fft_input;           // (thread) FFT input buffers, executed with fftwf_execute_dft_r2c
+    vector<fftwf_complex *> thread_fft_output;  // (thread) FFT output buffers
+    vector<vector<complex<float>>> thread_steered_bins; // (thread, b / 2 + 1) accumulator for one direction
+    vector<vector<complex<float>>> thread_channel_steering; // (thread, channel) steering vector for one bin
+    array3D<complex<float>> data_channel_fft; // (m, n, b / 2 + 1)
+    array3D<float> data_fft;          // (theta, phi, b / 2 + 1) linear power
+    array2D<float> post_process_gain; // (post_processing, b / 2 + 1) linear power gain
+    array2D<float> data_fft_collapse; // (theta, phi) dB
 
     // Delay
     stk::DelayL delay; // STK delay object
 };
 
+bool beamform_params::valid() const
+{
+    if (fft_size < 64 || fft_size % 2 != 0)
+    {
+        cerr << "FFT size has to be even and at least 64: " << fft_size << "\n";
+        return false;
+    }
+
+    if (m_channels < 1 || m_channels > mics.getRows() || n_channels < 1 || n_channels > mics.getColumns())
+    {
+        cerr << "Array has to fit in the " << mics.getRows() << "x" << mics.getColumns() << " geometry: " << m_channels << "x" << n_channels << "\n";
+        return false;
+    }
+
+    if (step_theta < 1 || step_phi < 1 || max_theta < min_theta || max_phi < min_phi)
+    {
+        cerr << "Invalid angle grid.\n";
+        return false;
+    }
+
+    if (min_theta < -90 || max_theta > 90 || min_phi < -90 || max_phi > 90)
+    {
+        cerr << "Angles have to be within -90 to 90 degrees.\n";
+        return false;
+    }
+
+    if (speed_of_sound <= 0.0f || num_taps < 1)
+    {
+        cerr << "Speed of sound and taps have to be positive.\n";
+        return false;
+    }
+
+    // The time domain engine reads the delayed span and one sample before it from the previous window
+    const float max_delay = maxDelay();
+    if (max_delay + 1 >= fft_size)
+    {
+        cerr << "Maximum delay of " << max_delay << " samples does not fit in an FFT of " << fft_size << ", use a larger FFT or a smaller array.\n";
+        return false;
+    }
+
+    return true;
+} // end valid
+
+float beamform_params::maxDelay() const
+{
+    float min_delay = MAXFLOAT;
+    float max_delay = -MAXFLOAT;
+
+    for (int theta = min_theta; theta <= max_theta; theta += step_theta)
+    {
+        for (int phi = min_phi; phi <= max_phi; phi += step_phi)
+        {
+            const float theta_r = theta * (M_PI / 180.0f);
+            const float phi_r = phi * (M_PI / 180.0f);
+            const float normal_x = sinf(theta_r) * cosf(phi_r);
+            const float normal_y = sinf(theta_r) * sinf(phi_r);
+            const float normal_z = cosf(theta_r);
+
+            for (int m = 0; m < m_channels; m++)
+            {
+                for (int n = 0; n < n_channels; n++)
+                {
+                    const vec3<float> &position = mics.at(m, n).position;
+                    const float delay_samples = -(normal_x * position.x + normal_y * position.y + normal_z * position.z) / speed_of_sound * sample_rate;
+                    min_delay = min(min_delay, delay_samples);
+                    max_delay = max(max_delay, delay_samples);
+                } // end n
+            } // end m
+        } // end phi
+    } // end theta
+
+    return max_delay - min_delay;
+} // end maxDelay
+
+beamform_params defaultBeamformParams(const geometry &mics)
+{
+    beamform_params params;
+    params.fft_size = FFT_SIZE;
+    params.sample_rate = SAMPLE_RATE;
+    params.m_channels = mics.getRows();
+    params.n_channels = mics.getColumns();
+    params.num_taps = NUM_TAPS;
+    params.mics = mics;
+    params.speed_of_sound = speedOfSound(AIR_TEMPERATURE);
+    params.min_theta = MIN_THETA;
+    params.max_theta = MAX_THETA;
+    params.step_theta = STEP_THETA;
+    params.min_phi = MIN_PHI;
+    params.max_phi = MAX_PHI;
+    params.step_phi = STEP_PHI;
+    return params;
+} // end defaultBeamformParams
+
+float speedOfSound(const float temperature)
+{
+    return 331.3f * sqrtf(1.0f + temperature / 273.15f);
+} // end speedOfSound
+
+//=====================================================================================
+
 beamform::beamform(const int fft_size, const int sample_rate, const int m_channels, const int n_channels, const int num_taps,
                    const float mic_spacing, const float speed_of_sound,
                    const int min_theta, const int max_theta, const int step_theta, const int num_theta,
-                   const int min_phi, const int max_phi, const int step_phi, const int num_phi) : fft_size(fft_size),
+                   const int min_phi, const int max_phi, const int step_phi, const int num_phi) : params{fft_size, sample_rate, m_channels, n_channels, num_taps,
+                                                                                                         geometry(m_channels, n_channels, mic_spacing), speed_of_sound,
+                                                                                                         min_theta, max_theta, step_theta,
+                                                                                                         min_phi, max_phi, step_phi},
+                                                                                                  fft_size(fft_size),
                                                                                                   sample_rate(sample_rate),
                                                                                                   m_channels(m_channels),
                                                                                                   n_channels(n_channels),
@@ -122,8 +466,11 @@ beamform::beamform(const int fft_size, const int sample_rate, const int m_channe
                                                                                                   num_taps(num_taps),
                                                                                                   tap_offset(-floor(num_taps / 2)),
 
-                                                                                                  mic_spacing(mic_spacing),
+                                                                                                  mics(m_channels, n_channels, mic_spacing),
+                                                                                                  uniform_grid(true),
+                                                                                                  delays_fit(true),
                                                                                                   speed_of_sound(speed_of_sound),
+                                                                                                  base_speed_of_sound(speed_of_sound),
 
                                                                                                   min_theta(min_theta),
                                                                                                   max_theta(max_theta),
@@ -134,26 +481,76 @@ beamform::beamform(const int fft_size, const int sample_rate, const int m_channe
                                                                                                   step_phi(step_phi),
                                                                                                   num_phi(num_phi),
 
+                                                                                                  kernel_type(BEAMFORM_KERNEL),
+                                                                                                  engine_type(BEAMFORM_ENGINE),
+                                                                                                  requested_engine(BEAMFORM_ENGINE),
+                                                                                                  num_threads(BEAMFORM_THREADS > 0 ? BEAMFORM_THREADS : omp_get_max_threads()),
+                                                                                                  quality(BEAMFORM_QUALITY),
+                                                                                                  max_band_bins(0),
+                                                                                                  csm_max_blocks(0),
+                                                                                                  cell_evaluated(num_theta, num_phi),
+
+                                                                                                  spatial_size(SPATIAL_FFT_SIZE),
+                                                                                                  spatial_power(SPATIAL_FFT_SIZE, SPATIAL_FFT_SIZE),
+                                                                                                  spatial_m_step(num_theta, num_phi),
+                                                                                                  spatial_n_step(num_theta, num_phi),
+
+                                                                                                  separable_row(num_theta, num_phi),
+                                                                                                  separable_n_delay(num_theta, num_phi),
+
+                                                                                                  cross_spectra(m_channels * n_channels, fft_size / 2 + 1, CSM_AVERAGES, CSM_FORGET_FACTOR),
+                                                                                                  csm_snapshot(m_channels * n_channels, fft_size / 2 + 1),
+                                                                                                  csm_hop(max(1, static_cast<int>(roundf(fft_size * (1.0f - CSM_OVERLAP))))),
+                                                                                                  csm_next_start(fft_size),
+                                                                                                  window_advance(fft_size),
+                                                                                                  window_contiguous(0),
+                                                                                                  window_sequence(-1),
+
                                                                                                   beamform_time("Beamform"),
                                                                                                   fft_time("FFT"),
                                                                                                   fft_collapse_time("FFT Collapse"),
-                                                                                                  post_process_time("Post Process"),
+                                                                                                  process_time("Process"),
 
-                                                                                                  // delay_time_int(num_theta, num_phi, m_channels, n_channels),
-                                                                                                  // delay_time_frac(num_theta, num_phi, m_channels, n_channels),
+                                                                                                  delay_time_int(num_theta, num_phi, m_channels, n_channels),
+                                                                                                  delay_time_frac(num_theta, num_phi, m_channels, n_channels),
                                                                                                   delay_time(num_theta, num_phi, m_channels, n_channels),
+                                                                                                  delay_time_base(num_theta, num_phi, m_channels, n_channels),
+                                                                                                  steering_step(num_theta, num_phi, m_channels, n_channels),
                                                                                                   // FIR_weights(num_theta, num_phi, m_channels, n_channels, num_taps),
+                                                                                                  hamming_weights(fft_size),
+                                                                                                  data_window(m_channels, n_channels, 2 * fft_size),
                                                                                                   data_beamform(num_theta, num_phi, fft_size),
+                                                                                                  data_channel_fft(m_channels, n_channels, fft_size / 2 + 1),
                                                                                                   data_fft(num_theta, num_phi, fft_size / 2 + 1),
+                                                                                                  post_process_gain(NUM_POST_PROCESSING, fft_size / 2 + 1),
                                                                                                   data_fft_collapse(num_theta, num_phi),
-                                                                                                  data_post_process(num_theta, num_phi),
-                                                                                                  delay()
+                                                                                                  delay(0.0, fft_size)
 {
 }
 
-beamform::~beamform()
+beamform::beamform(const beamform_params &params) : beamform(params.fft_size, params.sample_rate, params.m_channels, params.n_channels, params.num_taps,
+                                                             MIC_SPACING, params.speed_of_sound,
+                                                             params.min_theta, params.max_theta, params.step_theta, params.numTheta(),
+                                                             params.min_phi, params.max_phi, params.step_phi, params.numPhi())
 {
+    // Replace the placeholder lattice
+    this->params = params;
+    mics = params.mics;
+    uniform_grid = mics.isUniform();
+    applyEngine(); // Falls back if the default engine needs a uniform grid
+}
 
+beamform::~beamform()
+{
+    // Plans only exist after setup()
+    freeThreadBuffers();
+    if (fft_plan) {fftwf_destroy_plan(fft_plan);}
+    if (fft_batch_plan) {fftwf_destroy_plan(fft_batch_plan);}
+    if (spatial_plan) {fftwf_destroy_plan(spatial_plan);}
+    fftwf_free(fft_input_buffer);
+    fftwf_free(fft_output_buffer);
+    fftwf_free(data_spectrum);
+    fftwf_free(spatial_buffer);
 } // end ~beamform
 
 //=====================================================================================
@@ -192,28 +589,9 @@ void beamform::setupDelays()
             {
                 for (int n = 0; n < delay_time.dim_4; n++)
                 {
-                    // Distance between the origin and a normal vector from (m, n)
-                    float numerator = normal.x * m * mic_spacing + normal.y * n * mic_spacing;
-                    float denominator = normal.x * normal.x + normal.y * normal.y + normal.z * normal.z;
-                    float distance = numerator / denominator;
-
-                    // Coordinate of the point from the normal vector, projected onto the plane
-                    vec3<float> plane;
-                    plane.x = m * mic_spacing - distance * normal.x;
-                    plane.y = n * mic_spacing - distance * normal.y;
-                    plane.z = -distance * normal.z;
-
-                    // Magnitude of the plane vector
-                    vec3<float> magnitude_comp;
-                    magnitude_comp.x = m * mic_spacing - plane.x;
-                    magnitude_comp.y = n * mic_spacing - plane.y;
-                    magnitude_comp.z = -plane.z;
-                    int sign = 1;
-                    if (signbit(plane.z))
-                    {
-                        sign = -1;
-                    }
-                    float magnitude = sign * sqrtf(magnitude_comp.x * magnitude_comp.x + magnitude_comp.y * magnitude_comp.y + magnitude_comp.z * magnitude_comp.z); // signbit to account for if delay is ahead or behind (0,0) element
+                    // Arrival of the wavefront at the mic relative to the origin, in meters (-normal . position)
+                    const vec3<float> &position = mics.at(m, n).position;
+                    float magnitude = -(normal.x * position.x + normal.y * position.y + normal.z * position.z);
 
                     // Delay time in samples
                     float delay_samples = (magnitude / speed_of_sound) * sample_rate;
@@ -259,6 +637,204 @@ void beamform::setupDelays()
 
 //=====================================================================================
 
+void beamform::splitDelays()
+{
+    const int num_delays = delay_time.dim_1 * delay_time.dim_2 * delay_time.dim_3 * delay_time.dim_4;
+
+    // Split into integer and fractional parts for the SIMD kernel
+    float max_delay = 0.0f;
+    for (int i = 0; i < num_delays; i++)
+    {
+        float delay_samples = delay_time.data[i];
+        delay_time_int.data[i] = static_cast<int>(floorf(delay_samples));
+        delay_time_frac.data[i] = delay_samples - floorf(delay_samples);
+        max_delay = max(max_delay, delay_samples);
+    } // end i
+
+    // Time domain kernels read one sample before the integer delay, which has to stay inside the previous window
+    const bool fit = max_delay + 1 < fft_size;
+    if (fit != delays_fit)
+    {
+        delays_fit = fit;
+        if (!delays_fit)
+        {
+            cerr << "Maximum delay of " << max_delay << " samples does not fit in one window.\n";
+        }
+        applyEngine(); // Falls back from the requested engine, or returns to it once the delays fit again
+    }
+} // end splitDelays
+
+//=====================================================================================
+
+/*
+    Every delay is (distance / c) * sample_rate, offset by the minimum which scales the same way,
+    so a new c only scales the tables. delay_time is always scaled from the table built in setup(),
+    never from the last rescale, so rounding does not add up over temperature changes. The split,
+    the steering phases (one sincos per entry) and the spatial FFT and separable tables are
+    rebuilt from it. About 0.1 ms for the default grid and 6 ms for a 1 degree hemisphere.
+*/
+void beamform::rescaleDelays()
+{
+    const int num_delays = delay_time.dim_1 * delay_time.dim_2 * delay_time.dim_3 * delay_time.dim_4;
+    const float phase_scale = -2.0f * M_PI / fft_size;
+    const float ratio = base_speed_of_sound / speed_of_sound;
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int i = 0; i < num_delays; i++)
+    {
+        delay_time.data[i] = delay_time_base.data[i] * ratio;
+        steering_step.data[i] = polar(1.0f, phase_scale * delay_time.data[i]);
+    } // end i
+
+    splitDelays();
+
+    // Row delays are regrouped at SEPARABLE_RESOLUTION for the new delays
+    if (uniform_grid)
+    {
+        setupSpatialFFT();
+        setupSeparable();
+    }
+} // end rescaleDelays
+
+//=====================================================================================
+
+uint64_t beamform::tableKey()
+{
+    const int32_t version = TABLE_CACHE_VERSION;
+    const int32_t settings[] = {fft_size, sample_rate, m_channels, n_channels,
+                                min_theta, step_theta, num_theta, min_phi, step_phi, num_phi};
+
+    uint64_t key = fnv1a(&version, sizeof(version));
+    key = fnv1a(settings, sizeof(settings), key);
+    key = fnv1a(&speed_of_sound, sizeof(speed_of_sound), key);
+    for (int m = 0; m < m_channels; m++)
+    {
+        for (int n = 0; n < n_channels; n++)
+        {
+            const vec3<float> &position = mics.at(m, n).position;
+            const float coordinates[] = {position.x, position.y, position.z};
+            key = fnv1a(coordinates, sizeof(coordinates), key);
+        } // end n
+    } // end m
+    return key;
+} // end tableKey
+
+//=====================================================================================
+
+void beamform::setupSteering()
+{
+    // A delay of d samples rotates bin b by exp(-j * 2pi * b * d / fft_size)
+    for (int theta = 0; theta < steering_step.dim_1; theta++)
+    {
+        for (int phi = 0; phi < steering_step.dim_2; phi++)
+        {
+            for (int m = 0; m < steering_step.dim_3; m++)
+            {
+                for (int n = 0; n < steering_step.dim_4; n++)
+                {
+                    float phase = -2.0f * M_PI * delay_time.at(theta, phi, m, n) / fft_size;
+                    steering_step.at(theta, phi, m, n) = polar(1.0f, phase);
+                } // end n
+            } // end m
+        } // end phi
+    } // end theta
+} // end setupSteering
+
+//=====================================================================================
+
+/*
+    On a uniform grid the delay is d(m, n) = d(0, 0) + m * a + n * b, so steering bin k is
+    sum of X(m, n) * exp(-j * 2pi * k * (m * a + n * b) / fft_size). That is a 2D DFT over
+    (m, n) evaluated at row k * a * spatial_size / fft_size and column k * b * spatial_size / fft_size.
+    Power is bilinearly interpolated between FFT cells; with a 32x32 FFT on the 4x4 array the
+    map stays within ~3% of peak power of ENGINE_FREQUENCY_DOMAIN (64x64 brings it under 1%).
+*/
+void beamform::setupSpatialFFT()
+{
+    for (int theta = 0; theta < spatial_m_step.dim_1; theta++)
+    {
+        for (int phi = 0; phi < spatial_m_step.dim_2; phi++)
+        {
+            float a = (m_channels > 1) ? delay_time.at(theta, phi, 1, 0) - delay_time.at(theta, phi, 0, 0) : 0.0f;
+            float b = (n_channels > 1) ? delay_time.at(theta, phi, 0, 1) - delay_time.at(theta, phi, 0, 0) : 0.0f;
+
+            spatial_m_step.at(theta, phi) = a * spatial_size / fft_size;
+            spatial_n_step.at(theta, phi) = b * spatial_size / fft_size;
+        } // end phi
+    } // end theta
+
+    if (m_channels > spatial_size || n_channels > spatial_size)
+    {
+        cerr << "Error: Spatial FFT size is smaller than the array.\n";
+    }
+} // end setupSpatialFFT
+
+//=====================================================================================
+
+/*
+    On a planar grid d(m, n) = d(0, 0) + m * a + n * b. Directions are grouped by a, rounded to
+    1 / SEPARABLE_RESOLUTION of a sample, so the partial beams along M are shared by every
+    direction in the group. The number of groups is bounded by the delay range, not the grid.
+*/
+void beamform::setupSeparable()
+{
+    separable_m_delay.clear();
+    unordered_map<int, int> groups; // Rounded row delay in 1 / SEPARABLE_RESOLUTION samples to its index
+
+    for (int theta = 0; theta < separable_row.dim_1; theta++)
+    {
+        for (int phi = 0; phi < separable_row.dim_2; phi++)
+        {
+            float a = (m_channels > 1) ? delay_time.at(theta, phi, 1, 0) - delay_time.at(theta, phi, 0, 0) : 0.0f;
+            float b = (n_channels > 1) ? delay_time.at(theta, phi, 0, 1) - delay_time.at(theta, phi, 0, 0) : 0.0f;
+            const int a_steps = static_cast<int>(roundf(a * SEPARABLE_RESOLUTION));
+
+            // Reuse an existing group if this row delay was already seen
+            auto group = groups.find(a_steps);
+            if (group == groups.end())
+            {
+                group = groups.emplace(a_steps, separable_m_delay.size()).first;
+                separable_m_delay.push_back(static_cast<float>(a_steps) / SEPARABLE_RESOLUTION);
+            }
+
+            separable_row.at(theta, phi) = group->second;
+            separable_n_delay.at(theta, phi) = b;
+        } // end phi
+    } // end theta
+
+    separable_partial.assign(separable_m_delay.size() * n_channels, complex<float>(0.0f, 0.0f));
+} // end setupSeparable
+
+//=====================================================================================
+
+void beamform::setupHierarchy()
+{
+    // Every HIERARCHY_COARSE_STRIDE-th line plus the last, so interpolation reaches the edges
+    coarse_theta.clear();
+    for (int theta = 0; theta < num_theta; theta += HIERARCHY_COARSE_STRIDE)
+    {
+        coarse_theta.push_back(theta);
+    } // end theta
+    if (coarse_theta.back() != num_theta - 1)
+    {
+        coarse_theta.push_back(num_theta - 1);
+    }
+
+    coarse_phi.clear();
+    for (int phi = 0; phi < num_phi; phi += HIERARCHY_COARSE_STRIDE)
+    {
+        coarse_phi.push_back(phi);
+    } // end phi
+    if (coarse_phi.back() != num_phi - 1)
+    {
+        coarse_phi.push_back(num_phi - 1);
+    }
+
+    setDenseGrid();
+} // end setupHierarchy
+
+//=====================================================================================
+
 void beamform::setupFIR()
 {
     /* // Calculate taps from -num_taps / 2. Index from 0
@@ -305,54 +881,173 @@ void beamform::setupFIR()
 
 void beamform::setupFFT()
 {
-    /*
-        // Enable FFTW multithreading
+    // Enable FFTW multithreading for the batched plan (only once per process)
+    static bool fftw_threads_ready = false;
+    if (!fftw_threads_ready)
+    {
         if (fftwf_init_threads() == 0)
         {
             cerr << "Error: FFTW threading initialization failed.\n";
             throw runtime_error("FFTW threading initialization failed");
         }
 
-        // Set the number of threads for FFTW
-        fftwf_plan_with_nthreads(omp_get_max_threads()); // Use all available threads
+        // A replacement beamformer plans on a background thread while this one executes
+        fftwf_make_planner_thread_safe();
+        fftw_threads_ready = true;
+    }
+
+    // Load plans measured on a previous start
+    string wisdom_file = wisdomFilename();
+    bool has_wisdom = fftwf_import_wisdom_from_filename(wisdom_file.c_str()) != 0;
+
+    // Allocate all arrays (fftwf_malloc so every thread buffer has the alignment the plan was made with)
+    fft_input_buffer = fftwf_alloc_real(fft_size);                                                 // Allocate buffer for FFT input
+    fft_output_buffer = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (fft_size / 2 + 1)); // Allocate buffer for FFT output
+    data_spectrum = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * num_theta * num_phi * (fft_size / 2 + 1));
+
+    // Create single direction FFT plan (executed by every worker on its own buffers)
+    fftwf_plan_with_nthreads(1);
+    fft_plan = fftwf_plan_dft_r2c_1d(fft_size, fft_input_buffer, fft_output_buffer, FFTW_PLANNER);
+
+    // Create batched FFT plan over every direction, reading data_beamform rows in place
+    fftwf_plan_with_nthreads(num_threads);
+    int size[] = {fft_size};
+    fft_batch_plan = fftwf_plan_many_dft_r2c(1, size, num_theta * num_phi,
+                                             data_beamform.data, nullptr, 1, fft_size,
+                                             data_spectrum, nullptr, 1, fft_size / 2 + 1,
+                                             FFTW_PLANNER);
+    fftwf_plan_with_nthreads(1);
+
+    if (!fft_plan || !fft_batch_plan)
+    {
+        cerr << "Error: Failed to create FFT plan.\n";
+        throw runtime_error("FFTW plan creation failed");
+    }
 
-        float *input = reinterpret_cast<float *>(data_beamform.data);             // Allocate real input array
-        fftwf_complex *output = reinterpret_cast<fftwf_complex *>(data_fft.data); // Allocate complex output array
+    // Scratch for every worker thread
+    setupThreadBuffers();
 
-        fft_plan = fftwf_plan_dft_r2c_3d(data_beamform.dim_1, data_beamform.dim_2, data_beamform.dim_3,
-                                         input, output,
-                                         FFTW_ESTIMATE);
+    // Create in-place spatial FFT plan
+    spatial_buffer = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * spatial_size * spatial_size);
+    spatial_plan = fftwf_plan_dft_2d(spatial_size, spatial_size, spatial_buffer, spatial_buffer, FFTW_FORWARD, FFTW_PLANNER);
 
-        if (!fft_plan)
+    // Save plans so the measuring is only paid once per machine
+    if (!has_wisdom)
+    {
+        mkdir(FFTW_WISDOM_DIR, 0755);
+        if (fftwf_export_wisdom_to_filename(wisdom_file.c_str()) == 0)
         {
-            cerr << "Error: Failed to create FFT plan.\n";
-            throw runtime_error("FFTW plan creation failed");
+            cerr << "Could not write FFTW wisdom to " << wisdom_file << "\n";
         }
-     */
+    }
 
-    // Allocate all arrays
-    fft_input_buffer = new float[FFT_SIZE];                                                        // Allocate buffer for FFT input
-    fft_output_buffer = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (FFT_SIZE / 2 + 1)); // Allocate buffer for FFT output
+} // end setupFFT
 
-    // Create FFT plan
-    fft_plan = fftwf_plan_dft_r2c_1d(FFT_SIZE, fft_input_buffer, fft_output_buffer, FFTW_ESTIMATE);
+//=====================================================================================
 
-} // end setupFFT
+string beamform::wisdomFilename()
+{
+    // CPU name from /proc/cpuinfo ("model name" on x86, "Model" on the Pi)
+    string cpu_name = "unknown";
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line))
+    {
+        if (line.rfind("model name", 0) == 0 || line.rfind("Model", 0) == 0)
+        {
+            cpu_name = line.substr(line.find(':') + 1);
+            break;
+        }
+    }
+
+    // Keep only characters that are safe in a file name
+    string cpu_key;
+    for (char c : cpu_name)
+    {
+        if (isalnum(static_cast<unsigned char>(c))) {cpu_key += c;}
+        else if (!cpu_key.empty() && cpu_key.back() != '_') {cpu_key += '_';}
+    }
+
+    return string(FFTW_WISDOM_DIR) + "/fftwf_" + cpu_key +
+           "_n" + to_string(fft_size) +
+           "_b" + to_string(num_theta * num_phi) +
+           "_t" + to_string(num_threads) + ".wisdom";
+} // end wisdomFilename
+
+//=====================================================================================
+
+void beamform::setupThreadBuffers()
+{
+    freeThreadBuffers();
+
+    for (int thread = 0; thread < num_threads; thread++)
+    {
+        thread_fft_input.push_back(fftwf_alloc_real(fft_size));
+        thread_fft_output.push_back((fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (fft_size / 2 + 1)));
+        thread_steered_bins.push_back(vector<complex<float>>(fft_size / 2 + 1));
+        thread_channel_steering.push_back(vector<complex<float>>(num_channels));
+    } // end thread
+} // end setupThreadBuffers
+
+void beamform::freeThreadBuffers()
+{
+    for (int thread = 0; thread < thread_fft_input.size(); thread++)
+    {
+        fftwf_free(thread_fft_input[thread]);
+        fftwf_free(thread_fft_output[thread]);
+    } // end thread
+
+    thread_fft_input.clear();
+    thread_fft_output.clear();
+    thread_steered_bins.clear();
+    thread_channel_steering.clear();
+} // end freeThreadBuffers
 
 //=====================================================================================
 
 void beamform::setup()
 {
-    // Setup delays
-    setupDelays();
-    // cout << "setupDelays\n";
+    // Delays and steering phases from the table cache, computed and saved on a miss
+    table_cache cache(tableKey());
+    const size_t num_entries = delay_time.dim_1 * delay_time.dim_2 * delay_time.dim_3 * delay_time.dim_4;
+    if (!cache.load() ||
+        !cache.read(TABLE_DELAY, delay_time.data, num_entries * sizeof(float)) ||
+        !cache.read(TABLE_STEERING, steering_step.data, num_entries * sizeof(complex<float>)))
+    {
+        // Setup delays
+        setupDelays();
+        // cout << "setupDelays\n";
+
+        // Setup steering phases for the frequency domain engine
+        setupSteering();
+
+        cache.add(TABLE_DELAY, delay_time.data, num_entries * sizeof(float));
+        cache.add(TABLE_STEERING, steering_step.data, num_entries * sizeof(complex<float>));
+        cache.save();
+    }
+    copy(delay_time.data, delay_time.data + num_entries, delay_time_base.data);
+    base_speed_of_sound = speed_of_sound;
+    splitDelays();
+
+    // Spatial FFT and separable engines need mics on a uniform grid
+    if (uniform_grid)
+    {
+        // Setup grid lookup for the spatial FFT engine
+        setupSpatialFFT();
+
+        // Setup row delay groups for the separable engine
+        setupSeparable();
+    }
+
+    // Setup coarse grid for the hierarchical search
+    setupHierarchy();
 
     // Setup FIR weights
     // setupFIR();
     // cout << "setupFIR\n";
 
     // Setup Hamming window
-    for (int b = 0; b < FFT_SIZE; b++)
+    for (int b = 0; b < fft_size; b++)
     {
         float a0 = (25.0f / 46.0f); // Magic numbers
         hamming_weights[b] = a0 - (1.0f - a0) * cosf((2 * M_PI * static_cast<float>(b)) / static_cast<float>(fft_size));
@@ -362,6 +1057,9 @@ void beamform::setup()
     setupFFT();
     // cout << "setupFFT\n";
 
+    // Setup post processing gains
+    setupPostProcess();
+
     // delay_time_frac.print_layer(0, 0);
     // FIR_weights.print_layer(0, 0, 0);
 } // end setup
@@ -389,7 +1087,8 @@ float beamform::accessBuffer(const int m, const int n, const int b, array3D<floa
 
 //=====================================================================================
 
-void beamform::handleBeamforming(array3D<float> &data_buffer_1, array3D<float> &data_buffer_2)
+// Single-threaded: one STK delay line, cleared and set for every channel of every direction
+void beamform::handleBeamformingSTK()
 {
     /*
     // #pragma omp for collapse(3) schedule(static, 4)
@@ -434,122 +1133,733 @@ void beamform::handleBeamforming(array3D<float> &data_buffer_1, array3D<float> &
     -
     */
 
-    for (int theta = 0; theta < data_beamform.dim_1; theta++)
+    const int num_active = active_cells.size();
+    for (int cell = 0; cell < num_active; cell++)
     {
-        for (int phi = 0; phi < data_beamform.dim_2; phi++)
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        float *output = &data_beamform.at(theta, phi, 0);
+        fill(output, output + fft_size, 0.0f);
+
+        for (int m = 0; m < m_channels; m++)
         {
-            for (int b = 0; b < data_beamform.dim_3; b++)
+            for (int n = 0; n < n_channels; n++)
             {
-                // Accumulator for beamforming result
-                float result = 0.0f;
-                for (int m = 0; m < m_channels; m++)
+                // Fed from just far enough back in the previous window to fill the line over the newest one
+                const int first = max(fft_size - delay_time_int.at(theta, phi, m, n) - 1, 0);
+                delay.clear();
+                delay.setDelay(delay_time.at(theta, phi, m, n)); // Set delay in STK delay object
+
+                for (int b = first; b < 2 * fft_size; b++)
                 {
-                    for (int n = 0; n < n_channels; n++)
+                    float delayed = delay.tick(data_window.at(m, n, b)); // Apply delay to input signal
+                    if (b >= fft_size)
                     {
-                        delay.setDelay(delay_time.at(theta, phi, m, n));                           // Set delay in STK delay object
-                        result += delay.tick(accessBuffer(m, n, b, data_buffer_1, data_buffer_2)); // Apply delay to input signal
-
-                    } // end n
-                } // end m
-
-                // Normalize and write result
-                data_beamform.at(theta, phi, b) = (result / num_channels) * hamming_weights[b]; // Apply Hamming window
+                        output[b - fft_size] += delayed;
+                    }
+                } // end b
+            } // end n
+        } // end m
 
-            } // end b
-        } // end phi
-    } // end theta
-} // end handleBeamforming
+        // Normalize and apply Hamming window
+        for (int b = 0; b < fft_size; b++)
+        {
+            output[b] = (output[b] / num_channels) * hamming_weights[b];
+        } // end b
+    } // end cell
+} // end handleBeamformingSTK
 
 //=====================================================================================
 
-void beamform::FFT()
+/*
+    The view holds whole capture periods and the window is the newest 2 * fft_size frames of
+    it, whatever the period. The sequence number of the newest block says how far the window
+    moved since the last frame, so consecutive frames overlap when the loop runs faster than
+    capture and skip samples when it runs slower; window_advance tells the CSM which.
+    Sequence numbers stay contiguous across dropped blocks and xruns, so the block timestamps
+    decide whether the audio is: at the newest block that does not follow its predecessor
+    within half a block, everything older is silenced and window_contiguous marks the join.
+*/
+void beamform::loadWindow(const audio_view &audio)
 {
-    // Loop through each mic and perform 1D FFT on each
-    for (int theta = 0; theta < data_beamform.dim_1; theta++)
+    // Newest window_size frames of the view, silence in front of them until the ring has that many
+    const int window_size = 2 * fft_size;
+    const int used = min(window_size, audio.frames());
+    const int silent = window_size - used;
+    const int first_frame = audio.frames() - used; // In the view
+
+    for (int m = 0; m < data_window.dim_1; m++)
     {
-        for (int phi = 0; phi < data_beamform.dim_2; phi++)
+        for (int n = 0; n < data_window.dim_2; n++)
         {
-            // Write data to input buffer
-            for (int b = 0; b < fft_size; b++)
-            {
-                fft_input_buffer[b] = data_beamform.at(theta, phi, b);
-            } // end b
+            float *window = &data_window.at(m, n, 0);
+            memset(window, 0, silent * sizeof(float));
 
-            // Call fft plan
-            fftwf_execute(fft_plan);
-
-            // Convert to dBfs
-            for (int b = 0; b < FFT_SIZE / 2 + 1; b++)
+            // Copy block by block, the blocks are not contiguous across the ring wrap
+            for (int frame = first_frame, position = silent; frame < audio.frames();)
             {
-                float real = fft_output_buffer[b][0] / fft_size; // Normalize by FFT size
-                float imag = fft_output_buffer[b][1] / fft_size; // Normalize by FFT size
-                float inside = real * real + imag * imag;
-                data_fft.at(theta, phi, b) = 20 * log10f(sqrt(inside));
-
+                const int block = frame / audio.block_frames;
+                const int offset = frame % audio.block_frames;
+                const int count = audio.block_frames - offset;
+                memcpy(window + position, audio.channel(block, m, n) + offset, count * sizeof(float));
+                frame += count;
+                position += count;
+            } // end frame
+        } // end n
+    } // end m
+
+    // Newest gap in time between the blocks of the window
+    const int64_t block_time = static_cast<int64_t>(audio.block_frames) * 1000000000LL / sample_rate;
+    window_contiguous = silent;
+    for (int block = audio.num_blocks - 1; block > first_frame / audio.block_frames; block--)
+    {
+        const int64_t step = audio.info(block).timestamp - audio.info(block - 1).timestamp;
+        if (llabs(step - block_time) > block_time / 2)
+        {
+            window_contiguous = silent + block * audio.block_frames - first_frame;
+            break;
+        }
+    } // end block
+
+    if (window_contiguous > silent)
+    {
+        for (int m = 0; m < data_window.dim_1; m++)
+        {
+            for (int n = 0; n < data_window.dim_2; n++)
+            {
+                memset(&data_window.at(m, n, 0), 0, window_contiguous * sizeof(float));
+            } // end n
+        } // end m
+    }
+
+    // How far the window moved since the last call, from the block sequence numbers (0 if no new block arrived)
+    const int64_t newest = audio.info(audio.num_blocks - 1).sequence;
+    window_advance = (window_sequence < 0) ? window_size : static_cast<int>(min<int64_t>(max<int64_t>(newest - window_sequence, 0) * audio.block_frames, window_size));
+    window_sequence = newest;
+} // end loadWindow
+
+//=====================================================================================
+
+bool beamform::checkBuffers(const audio_view &audio)
+{
+    if (audio.rows < m_channels || audio.columns < n_channels || audio.num_blocks < 1)
+    {
+        cerr << "Audio blocks do not cover the " << m_channels << "x" << n_channels << " array.\n";
+        return false;
+    }
+
+    return true;
+} // end checkBuffers
+
+//=====================================================================================
+
+void beamform::accumulateDelayed(float *output, const float *input, const float weight_0, const float weight_1, const int count)
+{
+    int b = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 w0 = _mm256_set1_ps(weight_0);
+    const __m256 w1 = _mm256_set1_ps(weight_1);
+    for (; b + 8 <= count; b += 8)
+    {
+        __m256 result = _mm256_loadu_ps(output + b);
+        result = _mm256_fmadd_ps(w0, _mm256_loadu_ps(input + b), result);
+        result = _mm256_fmadd_ps(w1, _mm256_loadu_ps(input + b - 1), result);
+        _mm256_storeu_ps(output + b, result);
+    } // end b
+#elif defined(__ARM_NEON)
+    const float32x4_t w0 = vdupq_n_f32(weight_0);
+    const float32x4_t w1 = vdupq_n_f32(weight_1);
+    for (; b + 4 <= count; b += 4)
+    {
+        float32x4_t result = vld1q_f32(output + b);
+        result = vmlaq_f32(result, w0, vld1q_f32(input + b));
+        result = vmlaq_f32(result, w1, vld1q_f32(input + b - 1));
+        vst1q_f32(output + b, result);
+    } // end b
+#endif
+
+    // Scalar tail (and whole span when no SIMD is available)
+    for (; b < count; b++)
+    {
+        output[b] += weight_0 * input[b] + weight_1 * input[b - 1];
+    } // end b
+} // end accumulateDelayed
+
+//=====================================================================================
+
+/*
+    Delay-and-sum over the newest buffer using linear interpolation between the two
+    samples around each fractional delay: x(b - d) = (1 - frac) * x[b - int] + frac * x[b - int - 1].
+    Samples older than the newest buffer come from buffer_1, so each channel reads one
+    contiguous span with no branching.
+
+    Tolerance: matches KERNEL_STK, which runs each channel through its own pass of an
+    stk::DelayL with the same interpolation, to within KERNEL_TOLERANCE_DB on the map; the
+    only differences are STK's double precision, summation order and FMA rounding.
+    bench.cpp checks this on every array size before timing.
+*/
+void beamform::handleBeamformingSIMD()
+{
+    const float channel_gain = 1.0f / num_channels; // Normalization folded into the weights
+
+    const int num_active = active_cells.size();
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cell = 0; cell < num_active; cell++)
+    {
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        float *output = &data_beamform.at(theta, phi, 0);
+        fill(output, output + fft_size, 0.0f);
+
+        for (int m = 0; m < m_channels; m++)
+        {
+            for (int n = 0; n < n_channels; n++)
+            {
+                float frac = delay_time_frac.at(theta, phi, m, n);
+                const float *input = &data_window.at(m, n, fft_size - delay_time_int.at(theta, phi, m, n)); // Start of the delayed span
+
+                accumulateDelayed(output, input, (1.0f - frac) * channel_gain, frac * channel_gain, fft_size);
+            } // end n
+        } // end m
+
+        // Apply Hamming window
+        for (int b = 0; b < fft_size; b++)
+        {
+            output[b] *= hamming_weights[b];
+        } // end b
+    } // end cell
+} // end handleBeamformingSIMD
+
+//=====================================================================================
+
+void beamform::channelFFT(const int lower_bin, const int upper_bin)
+{
+    const bool narrow_band = (upper_bin - lower_bin + 1) <= GOERTZEL_MAX_BINS;
+
+    #pragma omp parallel for collapse(2) schedule(static) num_threads(num_threads)
+    for (int m = 0; m < data_channel_fft.dim_1; m++)
+    {
+        for (int n = 0; n < data_channel_fft.dim_2; n++)
+        {
+            float *fft_input = thread_fft_input[omp_get_thread_num()];
+            fftwf_complex *fft_output = thread_fft_output[omp_get_thread_num()];
+
+            // Window the newest buffer
+            const float *input = &data_window.at(m, n, fft_size);
+            for (int b = 0; b < fft_size; b++)
+            {
+                fft_input[b] = input[b] * hamming_weights[b];
+            } // end b
+
+            // Narrow bands only need a few bins, which is cheaper than the whole FFT
+            if (narrow_band)
+            {
+                for (int b = lower_bin; b <= upper_bin; b++)
+                {
+                    data_channel_fft.at(m, n, b) = goertzel(fft_input, b) / static_cast<float>(fft_size);
+                } // end b
+                continue;
+            }
+
+            fftwf_execute_dft_r2c(fft_plan, fft_input, fft_output);
+
+            // Normalize by FFT size
+            for (int b = lower_bin; b <= upper_bin; b++)
+            {
+                data_channel_fft.at(m, n, b) = complex<float>(fft_output[b][0], fft_output[b][1]) / static_cast<float>(fft_size);
             } // end b
         } // end n
     } // end m
-} // end FFT
+} // end channelFFT
 
 //=====================================================================================
 
-void beamform::FFTCollapse(const int lower_frequency, const int upper_frequency)
+/*
+    Second order recursion s[i] = x[i] + 2cos(w) * s[i - 1] - s[i - 2] with w = 2pi * bin / fft_size,
+    then X(bin) = exp(jw) * s[N - 1] - s[N - 2]. About fft_size multiply-adds per bin against
+    ~5 * fft_size for a whole real FFT, hence GOERTZEL_MAX_BINS. The state is kept in double
+    because the recursion is marginally stable and low bins lose precision in float.
+*/
+complex<float> beamform::goertzel(const float *input, const int bin)
 {
-    /*
-        for (int theta = 0; theta < data_fft.dim_1; theta++)
+    const double omega = 2.0 * M_PI * bin / fft_size;
+    const double coefficient = 2.0 * cos(omega);
+
+    double s_1 = 0.0;
+    double s_2 = 0.0;
+    for (int b = 0; b < fft_size; b++)
+    {
+        double s_0 = input[b] + coefficient * s_1 - s_2;
+        s_2 = s_1;
+        s_1 = s_0;
+    } // end b
+
+    return complex<float>(static_cast<float>(cos(omega) * s_1 - s_2), static_cast<float>(sin(omega) * s_1));
+} // end goertzel
+
+//=====================================================================================
+
+/*
+    Delay-and-sum in the frequency domain: Y(b) = sum over mics of X(b) * exp(-j * 2pi * b * d / fft_size).
+    The phase for the first bin is computed directly and every following bin is one
+    complex multiply by steering_step, so only the selected bins cost anything.
+*/
+void beamform::handleFrequencyDomain(const int lower_bin, const int upper_bin)
+{
+    const int num_bins = upper_bin - lower_bin + 1;
+
+    const int num_active = active_cells.size();
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cell = 0; cell < num_active; cell++)
+    {
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        vector<complex<float>> &steered_bins = thread_steered_bins[omp_get_thread_num()];
+        fill(steered_bins.begin(), steered_bins.begin() + num_bins, complex<float>(0.0f, 0.0f));
+
+        for (int m = 0; m < m_channels; m++)
         {
-            for (int phi = 0; phi < data_fft.dim_2; phi++)
+            for (int n = 0; n < n_channels; n++)
             {
-                complex<float> sum = 0;
-                for (int b = lower_frequency; b <= upper_frequency; b++)
+                const complex<float> step = steering_step.at(theta, phi, m, n);
+                complex<float> weight = polar(1.0f, -2.0f * static_cast<float>(M_PI) * lower_bin * delay_time.at(theta, phi, m, n) / fft_size);
+                const complex<float> *input = &data_channel_fft.at(m, n, lower_bin);
+
+                for (int b = 0; b < num_bins; b++)
                 {
-                    sum += data_fft.at(theta, phi, b);
+                    steered_bins[b] += input[b] * weight;
+                    weight *= step;
                 } // end b
+            } // end n
+        } // end m
+
+        // Linear power
+        for (int b = 0; b < num_bins; b++)
+        {
+            data_fft.at(theta, phi, lower_bin + b) = norm(steered_bins[b] / static_cast<float>(num_channels));
+        } // end b
+    } // end cell
+} // end handleFrequencyDomain
+
+//=====================================================================================
+
+void beamform::handleSpatialFFT(const int lower_bin, const int upper_bin)
+{
+    const float channel_gain = 1.0f / static_cast<float>(num_channels * num_channels);
+
+    for (int bin = lower_bin; bin <= upper_bin; bin++)
+    {
+        // Zero-pad the mic spectra into the spatial grid
+        memset(spatial_buffer, 0, sizeof(fftwf_complex) * spatial_size * spatial_size);
+        for (int m = 0; m < m_channels; m++)
+        {
+            for (int n = 0; n < n_channels; n++)
+            {
+                complex<float> value = data_channel_fft.at(m, n, bin);
+                spatial_buffer[m * spatial_size + n][0] = real(value);
+                spatial_buffer[m * spatial_size + n][1] = imag(value);
+            } // end n
+        } // end m
 
-                data_fft_collapse.at(theta, phi) = abs(sum);
-            } // end phi
-        } // end theta
-     */
-    // dB addition
+        fftwf_execute(spatial_plan);
+
+        // Power of the whole steered response for this bin
+        for (int i = 0; i < spatial_size * spatial_size; i++)
+        {
+            float real = spatial_buffer[i][0];
+            float imag = spatial_buffer[i][1];
+            spatial_power.data[i] = (real * real + imag * imag) * channel_gain;
+        } // end i
+
+        // Resample onto the theta/phi grid with bilinear interpolation (spatial FFT wraps around)
+        const int num_active = active_cells.size();
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int cell = 0; cell < num_active; cell++)
+        {
+            const int theta = active_cells[cell] / num_phi;
+            const int phi = active_cells[cell] % num_phi;
+
+            float row = bin * spatial_m_step.at(theta, phi);
+            float col = bin * spatial_n_step.at(theta, phi);
+            row -= spatial_size * floorf(row / spatial_size);
+            col -= spatial_size * floorf(col / spatial_size);
+
+            int row_0 = static_cast<int>(row) % spatial_size;
+            int col_0 = static_cast<int>(col) % spatial_size;
+            int row_1 = (row_0 + 1) % spatial_size;
+            int col_1 = (col_0 + 1) % spatial_size;
+            float row_frac = row - floorf(row);
+            float col_frac = col - floorf(col);
+
+            float top    = (1.0f - col_frac) * spatial_power.at(row_0, col_0) + col_frac * spatial_power.at(row_0, col_1);
+            float bottom = (1.0f - col_frac) * spatial_power.at(row_1, col_0) + col_frac * spatial_power.at(row_1, col_1);
+            data_fft.at(theta, phi, bin) = (1.0f - row_frac) * top + row_frac * bottom;
+        } // end cell
+    } // end bin
+} // end handleSpatialFFT
+
+//=====================================================================================
+
+void beamform::handleSeparable(const int lower_bin, const int upper_bin)
+{
+    const int num_rows = separable_m_delay.size();
+
+    for (int bin = lower_bin; bin <= upper_bin; bin++)
+    {
+        const float bin_phase = -2.0f * static_cast<float>(M_PI) * bin / fft_size;
+
+        // First stage: partial beams along M for every row delay, O(M * N) per row delay
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int row = 0; row < num_rows; row++)
+        {
+            const complex<float> step = polar(1.0f, bin_phase * separable_m_delay[row]);
+            complex<float> *partial = &separable_partial[row * n_channels];
+
+            for (int n = 0; n < n_channels; n++)
+            {
+                partial[n] = complex<float>(0.0f, 0.0f);
+            } // end n
+
+            complex<float> weight(1.0f, 0.0f);
+            for (int m = 0; m < m_channels; m++)
+            {
+                for (int n = 0; n < n_channels; n++)
+                {
+                    partial[n] += data_channel_fft.at(m, n, bin) * weight;
+                } // end n
+                weight *= step;
+            } // end m
+        } // end row
+
+        // Second stage: combine partial beams along N for every direction, O(N) per direction
+        const int num_active = active_cells.size();
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int cell = 0; cell < num_active; cell++)
+        {
+            const int theta = active_cells[cell] / num_phi;
+            const int phi = active_cells[cell] % num_phi;
+
+            const complex<float> *partial = &separable_partial[separable_row.at(theta, phi) * n_channels];
+            const complex<float> step = polar(1.0f, bin_phase * separable_n_delay.at(theta, phi));
+
+            complex<float> sum(0.0f, 0.0f);
+            complex<float> weight(1.0f, 0.0f);
+            for (int n = 0; n < n_channels; n++)
+            {
+                sum += partial[n] * weight;
+                weight *= step;
+            } // end n
+
+            data_fft.at(theta, phi, bin) = norm(sum / static_cast<float>(num_channels));
+        } // end cell
+    } // end bin
+} // end handleSeparable
+
+//=====================================================================================
+
+/*
+    Welch blocks are fft_size long and csm_hop apart. data_window holds the previous buffer
+    followed by the newest one, so every block starting in [csm_next_start, fft_size] fits.
+    The position is carried over from the last frame, shifted back by how far this window
+    moved (window_advance), so blocks already averaged are not added again and new audio is
+    not skipped; it never goes before window_contiguous, so no block spans a gap. With 50%
+    overlap and one buffer per frame that is two blocks per frame.
+*/
+void beamform::updateCSM()
+{
+    const int num_bins = fft_size / 2 + 1;
+
+    // Into this window's frame (blocks older than the window are lost)
+    csm_next_start = max(csm_next_start - window_advance, window_contiguous);
+
+    // Skip the oldest blocks when the frame budget limits the blocks per frame
+    int num_blocks = (csm_next_start <= fft_size) ? (fft_size - csm_next_start) / csm_hop + 1 : 0;
+    if (csm_max_blocks > 0 && num_blocks > csm_max_blocks)
+    {
+        csm_next_start += (num_blocks - csm_max_blocks) * csm_hop;
+    }
+
+    for (; csm_next_start + fft_size <= 2 * fft_size; csm_next_start += csm_hop)
+    {
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int channel = 0; channel < num_channels; channel++)
+        {
+            float *fft_input = thread_fft_input[omp_get_thread_num()];
+            fftwf_complex *fft_output = thread_fft_output[omp_get_thread_num()];
+
+            // Window the block
+            const float *input = &data_window.at(channel / n_channels, channel % n_channels, csm_next_start);
+            for (int b = 0; b < fft_size; b++)
+            {
+                fft_input[b] = input[b] * hamming_weights[b];
+            } // end b
+
+            fftwf_execute_dft_r2c(fft_plan, fft_input, fft_output);
+
+            // Normalize by FFT size
+            for (int b = 0; b < num_bins; b++)
+            {
+                csm_snapshot.at(channel, b) = complex<float>(fft_output[b][0], fft_output[b][1]) / static_cast<float>(fft_size);
+            } // end b
+        } // end channel
+
+        cross_spectra.addSnapshot(csm_snapshot);
+    } // end block
+} // end updateCSM
+
+//=====================================================================================
+
+void beamform::handleCSM(const int lower_bin, const int upper_bin)
+{
+    const int num_active = active_cells.size();
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cell = 0; cell < num_active; cell++)
+    {
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        complex<float> *steering = thread_channel_steering[omp_get_thread_num()].data();
+        const complex<float> *step = &steering_step.at(theta, phi, 0, 0);
+        const float *delay = &delay_time.at(theta, phi, 0, 0);
+
+        // Steering vector at the first bin, then one rotation per bin
+        for (int channel = 0; channel < num_channels; channel++)
+        {
+            steering[channel] = polar(1.0f, -2.0f * static_cast<float>(M_PI) * lower_bin * delay[channel] / fft_size);
+        } // end channel
+
+        for (int b = lower_bin; b <= upper_bin; b++)
+        {
+            data_fft.at(theta, phi, b) = cross_spectra.power(b, steering);
+
+            for (int channel = 0; channel < num_channels; channel++)
+            {
+                steering[channel] *= step[channel];
+            } // end channel
+        } // end b
+    } // end cell
+} // end handleCSM
+
+//=====================================================================================
+
+void beamform::FFT(const int lower_bin, const int upper_bin)
+{
+    const int num_bins = fft_size / 2 + 1;
+    const float normalization = 1.0f / (static_cast<float>(fft_size) * fft_size);
+
+    const int num_active = active_cells.size();
+
+    // Narrow bands: evaluate only the needed bins of every direction
+    if (upper_bin - lower_bin + 1 <= GOERTZEL_MAX_BINS)
+    {
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int cell = 0; cell < num_active; cell++)
+        {
+            const int theta = active_cells[cell] / num_phi;
+            const int phi = active_cells[cell] % num_phi;
+
+            const float *input = &data_beamform.at(theta, phi, 0);
+            for (int b = lower_bin; b <= upper_bin; b++)
+            {
+                data_fft.at(theta, phi, b) = norm(goertzel(input, b)) * normalization;
+            } // end b
+        } // end cell
+        return;
+    }
+
+    // Part of the grid: transform only the active directions (copied, the plan needs its own alignment)
+    if (num_active < num_theta * num_phi)
+    {
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int cell = 0; cell < num_active; cell++)
+        {
+            const int theta = active_cells[cell] / num_phi;
+            const int phi = active_cells[cell] % num_phi;
+
+            float *fft_input = thread_fft_input[omp_get_thread_num()];
+            fftwf_complex *fft_output = thread_fft_output[omp_get_thread_num()];
+            memcpy(fft_input, &data_beamform.at(theta, phi, 0), fft_size * sizeof(float));
+
+            fftwf_execute_dft_r2c(fft_plan, fft_input, fft_output);
+
+            for (int b = lower_bin; b <= upper_bin; b++)
+            {
+                data_fft.at(theta, phi, b) = (fft_output[b][0] * fft_output[b][0] + fft_output[b][1] * fft_output[b][1]) * normalization;
+            } // end b
+        } // end cell
+        return;
+    }
+
+    // Transform every direction at once
+    fftwf_execute(fft_batch_plan);
+
+    // Linear power, normalized by FFT size, only for the band
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cell = 0; cell < num_active; cell++)
+    {
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        const fftwf_complex *spectrum = &data_spectrum[(theta * num_phi + phi) * num_bins];
+        float *power = &data_fft.at(theta, phi, 0);
+        for (int b = lower_bin; b <= upper_bin; b++)
+        {
+            power[b] = (spectrum[b][0] * spectrum[b][0] + spectrum[b][1] * spectrum[b][1]) * normalization;
+        } // end b
+    } // end cell
+} // end FFT
+
+//=====================================================================================
+
+void beamform::FFTCollapse(const frequency_band &band, const uint8_t post_process_type, const float band_scale)
+{
+    const int num_bins = band.upper_bin - band.lower_bin + 1;
+    const float *gain = &post_process_gain.at(post_process_type, band.lower_bin);
+
+    // Share of each edge bin outside the band (a single bin band only has one edge weight)
+    const float lower_excess = 1.0f - band.lower_weight;
+    const float upper_excess = (num_bins > 1) ? 1.0f - band.upper_weight : 0.0f;
+
+    // Weighted power sum, then one dB conversion per direction
+    const int num_active = active_cells.size();
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int cell = 0; cell < num_active; cell++)
+    {
+        const int theta = active_cells[cell] / num_phi;
+        const int phi = active_cells[cell] % num_phi;
+
+        const float *power = &data_fft.at(theta, phi, band.lower_bin);
+
+        float sum = 0.0f;
+        #pragma omp simd reduction(+:sum)
+        for (int b = 0; b < num_bins; b++)
+        {
+            sum += power[b] * gain[b];
+        } // end b
+
+        // Remove the parts of the edge bins that lie outside the band
+        sum -= lower_excess * power[0] * gain[0];
+        sum -= upper_excess * power[num_bins - 1] * gain[num_bins - 1];
+
+        data_fft_collapse.at(theta, phi) = 10 * log10f(sum * band_scale);
+    } // end cell
+} // end FFTCollapse
+
+//=====================================================================================
+
+/*
+    Third octave bands tile the spectrum, so every bin is read by at most two bands (the
+    edge bin shared by neighbours). The cube costs one pass over data_fft per direction
+    and 25 log10 per direction instead of one.
+*/
+void beamform::FFTCollapseCube(array3D<float> &data_output, const bands &band_table, const uint8_t post_process_type)
+{
+    #pragma omp parallel for collapse(2) schedule(static) num_threads(num_threads)
     for (int theta = 0; theta < data_fft.dim_1; theta++)
     {
         for (int phi = 0; phi < data_fft.dim_2; phi++)
         {
-            float sum = 0;
-            for (int b = lower_frequency; b <= upper_frequency; b++)
+            for (int band_index = 0; band_index < NUM_THIRD_OCTAVE_BANDS; band_index++)
             {
-                sum += powf(10, data_fft.at(theta, phi, b) / 10);
-            } // end b
+                const frequency_band &band = band_table.third(band_index);
+                const int num_bins = band.upper_bin - band.lower_bin + 1;
+                const float *power = &data_fft.at(theta, phi, band.lower_bin);
+                const float *gain = &post_process_gain.at(post_process_type, band.lower_bin);
+
+                float sum = 0.0f;
+                #pragma omp simd reduction(+:sum)
+                for (int b = 0; b < num_bins; b++)
+                {
+                    sum += power[b] * gain[b];
+                } // end b
+
+                // Remove the parts of the edge bins that lie outside the band
+                sum -= (1.0f - band.lower_weight) * power[0] * gain[0];
+                if (num_bins > 1)
+                {
+                    sum -= (1.0f - band.upper_weight) * power[num_bins - 1] * gain[num_bins - 1];
+                }
 
-            data_fft_collapse.at(theta, phi) = 10 * log10f(sum);
-            // data_fft_collapse.at(theta, phi) = abs(sum) / (upper_frequency - lower_frequency + 1); // Normalize by number of bins
+                data_output.at(band_index, theta, phi) = 10 * log10f(sum);
+            } // end band_index
         } // end phi
     } // end theta
-} // end FFTCollapse
+} // end FFTCollapseCube
 
 //=====================================================================================
 
-void beamform::postProcess(const uint8_t post_process_type)
+void beamform::setupPostProcess()
 {
-    float max_signal_value = 1.0f;
-    for (int theta = 0; theta < data_fft_collapse.dim_1; theta++)
+    float max_signal_value = 1.0f; // Full scale amplitude
+
+    for (int type = 0; type < post_process_gain.dim_1; type++)
     {
-        for (int phi = 0; phi < data_fft_collapse.dim_2; phi++)
+        for (int b = 0; b < post_process_gain.dim_2; b++)
         {
-            switch (post_process_type)
+            switch (type)
             {
             case POST_dBFS:
-                // 20 * log10(abs(signal) / max_possible_value)
-                data_post_process.at(theta, phi) = 20 * log10f(data_fft_collapse.at(theta, phi) / max_signal_value); // Check the max value***
+                // Power relative to full scale
+                post_process_gain.at(type, b) = 1.0f / (max_signal_value * max_signal_value);
+                break;
+
+            case POST_dBZ:
+                // Z-weighting is flat
+                post_process_gain.at(type, b) = 1.0f;
+                break;
+
+            case POST_dBA:
+                post_process_gain.at(type, b) = weightingGain(POST_dBA, static_cast<float>(b) * sample_rate / fft_size);
+                break;
+
+            case POST_dBC:
+                post_process_gain.at(type, b) = weightingGain(POST_dBC, static_cast<float>(b) * sample_rate / fft_size);
                 break;
 
             default:
-                cerr << "Invalid post processing type.\n";
+                post_process_gain.at(type, b) = 1.0f;
                 break;
             } // end switch
-        } // end phi
-    } // end theta
-} // end postProcess
+        } // end b
+    } // end type
+} // end setupPostProcess
+
+//=====================================================================================
+
+// IEC 61672-1 A and C frequency weighting as a linear power gain
+float beamform::weightingGain(const uint8_t post_process_type, const float frequency)
+{
+    const double f2 = (double)frequency * frequency;
+    const double pole_1 = 20.598997 * 20.598997;
+    const double pole_2 = 107.65265 * 107.65265;
+    const double pole_3 = 737.86223 * 737.86223;
+    const double pole_4 = 12194.217 * 12194.217;
+
+    double response;
+    double offset_db;
+    switch (post_process_type)
+    {
+    case POST_dBA:
+        response = (pole_4 * f2 * f2) / ((f2 + pole_1) * sqrt((f2 + pole_2) * (f2 + pole_3)) * (f2 + pole_4));
+        offset_db = 2.0; // Normalizes to 0 dB at 1 kHz
+        break;
+
+    case POST_dBC:
+        response = (pole_4 * f2) / ((f2 + pole_1) * (f2 + pole_4));
+        offset_db = 0.062;
+        break;
+
+    default:
+        return 1.0f;
+    } // end switch
+
+    // Amplitude response squared, with the 1 kHz offset applied in dB
+    return static_cast<float>(response * response * pow(10.0, offset_db / 10.0));
+} // end weightingGain
 
 //=====================================================================================
 
@@ -562,46 +1872,402 @@ cv::Mat beamform::array2DtoMat(const array2D<float> &data)
 
 //=====================================================================================
 
-void beamform::processData(cv::Mat &data_output, const int lower_frequency, const int upper_frequency, const uint8_t post_process_type, array3D<float> &data_buffer_1, array3D<float> &data_buffer_2)
+void beamform::handleChannels(const int lower_bin, const int upper_bin, const audio_view &audio)
+{
+    switch (engine_type)
+    {
+    case ENGINE_TIME_DOMAIN:
+        loadWindow(audio);
+        break;
+
+    case ENGINE_FREQUENCY_DOMAIN:
+    case ENGINE_SPATIAL_FFT:
+    case ENGINE_SEPARABLE:
+        // FFT every mic once
+        fft_time.start();
+        loadWindow(audio);
+        channelFFT(lower_bin, upper_bin);
+        fft_time.end();
+        break;
+
+    case ENGINE_CSM:
+        // FFT every new Welch block and update the averaged CSM
+        fft_time.start();
+        loadWindow(audio);
+        updateCSM();
+        fft_time.end();
+        break;
+
+    default:
+        cerr << "Invalid beamforming engine.\n";
+        break;
+    } // end switch
+} // end handleChannels
+
+//=====================================================================================
+
+void beamform::handleDirections(const int lower_bin, const int upper_bin, const audio_view &audio)
 {
-    // Beamforming
-    // cout << "Handling Beamforming\n";
-    beamform_time.start();
-    handleBeamforming(data_buffer_1, data_buffer_2);
-    beamform_time.end();
+    switch (engine_type)
+    {
+    case ENGINE_TIME_DOMAIN:
+        // Beamforming
+        // cout << "Handling Beamforming\n";
+        beamform_time.start();
+        switch (kernel_type)
+        {
+        case KERNEL_STK:
+            handleBeamformingSTK();
+            break;
+
+        case KERNEL_SIMD:
+            handleBeamformingSIMD();
+            break;
+
+        default:
+            cerr << "Invalid beamforming kernel.\n";
+            break;
+        } // end switch
+        beamform_time.end();
 
 #ifdef PRINT_BEAMFORM
-    data_beamform.print_layer(100);
+        data_beamform.print_layer(100);
 #endif
 
-    // FFT
-    // cout << "Performing FFT\n";
-    fft_time.start();
-    FFT();
-    fft_time.end();
+        // FFT
+        // cout << "Performing FFT\n";
+        fft_time.start();
+        FFT(lower_bin, upper_bin);
+        fft_time.end();
+        break;
+
+    case ENGINE_FREQUENCY_DOMAIN:
+        // Steer by phase
+        beamform_time.start();
+        handleFrequencyDomain(lower_bin, upper_bin);
+        beamform_time.end();
+        break;
+
+    case ENGINE_SPATIAL_FFT:
+        // Steer with one spatial FFT per bin
+        beamform_time.start();
+        handleSpatialFFT(lower_bin, upper_bin);
+        beamform_time.end();
+        break;
+
+    case ENGINE_SEPARABLE:
+        // Steer along M, then along N
+        beamform_time.start();
+        handleSeparable(lower_bin, upper_bin);
+        beamform_time.end();
+        break;
+
+    case ENGINE_CSM:
+        // Steer the CSM
+        beamform_time.start();
+        handleCSM(lower_bin, upper_bin);
+        beamform_time.end();
+        break;
+
+    default:
+        cerr << "Invalid beamforming engine.\n";
+        break;
+    } // end switch
+} // end handleDirections
+
+//=====================================================================================
+
+void beamform::handleSpectrum(const int lower_bin, const int upper_bin, const audio_view &audio)
+{
+    handleChannels(lower_bin, upper_bin, audio);
+    handleDirections(lower_bin, upper_bin, audio);
 
 #ifdef PRINT_FFT
     data_fft.print_layer(23);
 #endif
+} // end handleSpectrum
+
+//=====================================================================================
+
+/*
+    Keeps the max_band_bins around the band center with full weight. The collapsed power is
+    scaled by the band's width over the kept width, which assumes a locally flat spectrum, so
+    the level stays comparable while the frame budget is active.
+*/
+frequency_band beamform::limitBand(const frequency_band &band, float &band_scale)
+{
+    band_scale = 1.0f;
+    const int num_bins = band.upper_bin - band.lower_bin + 1;
+    if (max_band_bins <= 0 || num_bins <= max_band_bins)
+    {
+        return band;
+    }
+
+    // Width of the band in bins, counting the edge weights
+    float band_width = num_bins - 2 + band.lower_weight + band.upper_weight;
+
+    frequency_band limited = band;
+    limited.lower_bin = (band.lower_bin + band.upper_bin + 1 - max_band_bins) / 2;
+    limited.upper_bin = limited.lower_bin + max_band_bins - 1;
+    limited.lower_weight = 1.0f;
+    limited.upper_weight = 1.0f;
+
+    band_scale = band_width / max_band_bins;
+    return limited;
+} // end limitBand
+
+//=====================================================================================
+
+void beamform::setDenseGrid()
+{
+    active_cells.resize(num_theta * num_phi);
+    for (int cell = 0; cell < num_theta * num_phi; cell++)
+    {
+        active_cells[cell] = cell;
+        cell_evaluated.data[cell] = 1;
+    } // end cell
+} // end setDenseGrid
+
+//=====================================================================================
+
+/*
+    Quality 1 refines down to stride 2, quality 2 down to the full grid. With the default
+    21 x 19 grid and stride 4 the coarse pass is 6 x 6 = 36 directions and every level adds
+    at most HIERARCHY_PEAKS * 8. In practice quality 2 evaluates 55 to 75 of 399 directions and
+    lands on the same peak as the full grid, except near broadside where the map is flat along phi.
+    Per-frame work (mic FFTs, CSM update) is done once.
+*/
+void beamform::handleHierarchical(const frequency_band &band, const float band_scale, const uint8_t post_process_type, const audio_view &audio)
+{
+    const int target_stride = (quality <= 1) ? 2 : 1;
 
-    // FFT Collapse
-    // cout << "Collapsing FFT\n";
+    fill(cell_evaluated.data, cell_evaluated.data + num_theta * num_phi, 0);
+
+    // Coarse pass
+    active_cells.clear();
+    for (int theta : coarse_theta)
+    {
+        for (int phi : coarse_phi)
+        {
+            active_cells.push_back(theta * num_phi + phi);
+            cell_evaluated.at(theta, phi) = 1;
+        } // end phi
+    } // end theta
+
+    handleChannels(band.lower_bin, band.upper_bin, audio);
+    handleDirections(band.lower_bin, band.upper_bin, audio);
     fft_collapse_time.start();
-    FFTCollapse(lower_frequency, upper_frequency);
+    FFTCollapse(band, post_process_type, band_scale);
     fft_collapse_time.end();
 
-#ifdef PRINT_FFT_COLLAPSE
-    data_fft_collapse.print();
-#endif
+    // Refine around the strongest peaks, halving the stride every level
+    for (int stride = HIERARCHY_COARSE_STRIDE / 2; stride >= target_stride; stride /= 2)
+    {
+        vector<int> peaks = findPeaks(HIERARCHY_PEAKS, 2 * stride);
+
+        active_cells.clear();
+        for (int peak : peaks)
+        {
+            for (int theta = peak / num_phi - stride; theta <= peak / num_phi + stride; theta += stride)
+            {
+                for (int phi = peak % num_phi - stride; phi <= peak % num_phi + stride; phi += stride)
+                {
+                    if (theta < 0 || theta >= num_theta || phi < 0 || phi >= num_phi || cell_evaluated.at(theta, phi))
+                    {
+                        continue;
+                    }
+                    active_cells.push_back(theta * num_phi + phi);
+                    cell_evaluated.at(theta, phi) = 1;
+                } // end phi
+            } // end theta
+        } // end peak
+
+        if (active_cells.empty())
+        {
+            break;
+        }
+
+        handleDirections(band.lower_bin, band.upper_bin, audio);
+        fft_collapse_time.start();
+        FFTCollapse(band, post_process_type, band_scale);
+        fft_collapse_time.end();
+    } // end stride
+
+    fillUnevaluated();
+} // end handleHierarchical
+
+//=====================================================================================
+
+vector<int> beamform::findPeaks(const int num_peaks, const int min_distance)
+{
+    // Evaluated cells, strongest first
+    vector<pair<float, int>> candidates;
+    for (int cell = 0; cell < num_theta * num_phi; cell++)
+    {
+        if (cell_evaluated.data[cell])
+        {
+            candidates.push_back(make_pair(data_fft_collapse.data[cell], cell));
+        }
+    } // end cell
+    sort(candidates.begin(), candidates.end(), greater<pair<float, int>>());
+
+    // Keep peaks that are not next to a stronger one already kept
+    vector<int> peaks;
+    for (int i = 0; i < candidates.size() && peaks.size() < num_peaks; i++)
+    {
+        int theta = candidates[i].second / num_phi;
+        int phi = candidates[i].second % num_phi;
+
+        bool is_separate = true;
+        for (int peak : peaks)
+        {
+            if (abs(peak / num_phi - theta) < min_distance && abs(peak % num_phi - phi) < min_distance)
+            {
+                is_separate = false;
+                break;
+            }
+        } // end peak
+
+        if (is_separate)
+        {
+            peaks.push_back(candidates[i].second);
+        }
+    } // end i
+
+    return peaks;
+} // end findPeaks
+
+//=====================================================================================
+
+/*
+    Each cell that was not evaluated is interpolated bilinearly from the smallest rectangle
+    around it with evaluated corners, at most HIERARCHY_COARSE_STRIDE per side. Refined
+    neighbourhoods give small rectangles, so the map follows the refined cells up to their
+    edges; elsewhere the coarse lattice always has one. A rectangle can be a line (a row or
+    column with evaluated cells either side).
+*/
+void beamform::fillUnevaluated()
+{
+    const int max_span = HIERARCHY_COARSE_STRIDE;
+
+    for (int theta = 0; theta < num_theta; theta++)
+    {
+        for (int phi = 0; phi < num_phi; phi++)
+        {
+            if (cell_evaluated.at(theta, phi))
+            {
+                continue;
+            }
+
+            // Smallest rectangle (theta_0, phi_0) to (theta_1, phi_1) with evaluated corners
+            int best_size = 2 * max_span + 1;
+            int best_theta_0 = theta, best_theta_1 = theta, best_phi_0 = phi, best_phi_1 = phi;
+            for (int theta_0 = theta; theta_0 >= max(theta - max_span, 0); theta_0--)
+            {
+                for (int theta_1 = theta; theta_1 <= min(theta_0 + max_span, num_theta - 1); theta_1++)
+                {
+                    for (int phi_0 = phi; phi_0 >= max(phi - max_span, 0); phi_0--)
+                    {
+                        for (int phi_1 = phi; phi_1 <= min(phi_0 + max_span, num_phi - 1); phi_1++)
+                        {
+                            const int size = (theta_1 - theta_0) + (phi_1 - phi_0);
+                            if (size >= best_size || size == 0)
+                            {
+                                continue;
+                            }
+
+                            if (cell_evaluated.at(theta_0, phi_0) && cell_evaluated.at(theta_0, phi_1) &&
+                                cell_evaluated.at(theta_1, phi_0) && cell_evaluated.at(theta_1, phi_1))
+                            {
+                                best_size = size;
+                                best_theta_0 = theta_0;
+                                best_theta_1 = theta_1;
+                                best_phi_0 = phi_0;
+                                best_phi_1 = phi_1;
+                            }
+                        } // end phi_1
+                    } // end phi_0
+                } // end theta_1
+            } // end theta_0
+
+            float theta_frac = (theta - best_theta_0) / static_cast<float>(max(best_theta_1 - best_theta_0, 1));
+            float phi_frac = (phi - best_phi_0) / static_cast<float>(max(best_phi_1 - best_phi_0, 1));
+
+            float top    = (1.0f - phi_frac) * data_fft_collapse.at(best_theta_0, best_phi_0) + phi_frac * data_fft_collapse.at(best_theta_0, best_phi_1);
+            float bottom = (1.0f - phi_frac) * data_fft_collapse.at(best_theta_1, best_phi_0) + phi_frac * data_fft_collapse.at(best_theta_1, best_phi_1);
+            data_fft_collapse.at(theta, phi) = (1.0f - theta_frac) * top + theta_frac * bottom;
+        } // end phi
+    } // end theta
+} // end fillUnevaluated
+
+//=====================================================================================
+
+void beamform::processData(cv::Mat &data_output, const int lower_frequency, const int upper_frequency, const uint8_t post_process_type, const audio_view &audio)
+{
+    const float bin_width = static_cast<float>(sample_rate) / fft_size;
+
+    frequency_band band;
+    band.center_frequency = 0.5f * (lower_frequency + upper_frequency) * bin_width;
+    band.lower_frequency = (lower_frequency - 0.5f) * bin_width;
+    band.upper_frequency = (upper_frequency + 0.5f) * bin_width;
+    band.lower_bin = lower_frequency;
+    band.upper_bin = upper_frequency;
+    band.lower_weight = 1.0f;
+    band.upper_weight = 1.0f;
+
+    processData(data_output, band, post_process_type, audio);
+} // end processData
+
+//=====================================================================================
+
+void beamform::processData(cv::Mat &data_output, const frequency_band &band, const uint8_t post_process_type, const audio_view &audio)
+{
+    if (post_process_type >= NUM_POST_PROCESSING)
+    {
+        cerr << "Invalid post processing type.\n";
+        return;
+    }
 
-    // Post Process
-    // cout << "Post Processing\n";
-    // post_process_time.start();
-    // postProcess(post_process_type);
-    // post_process_time.end();
+    if (band.lower_bin < 0 || band.upper_bin > fft_size / 2 || band.lower_bin > band.upper_bin)
+    {
+        cerr << "Invalid band: bins " << band.lower_bin << " to " << band.upper_bin << "\n";
+        return;
+    }
 
-#ifdef PRINT_POST_PROCESS
-    data_post_process.print();
+    if (!checkBuffers(audio))
+    {
+        return;
+    }
+
+    process_time.start();
+
+    // Fewer bins when the frame budget asks for it
+    float band_scale = 1.0f;
+    frequency_band used_band = limitBand(band, band_scale);
+
+    // The spatial FFT produces the whole map per bin anyway, so it always uses the full grid
+    if (quality < 3 && engine_type != ENGINE_SPATIAL_FFT)
+    {
+        // Coarse to fine search over the grid
+        handleHierarchical(used_band, band_scale, post_process_type, audio);
+    }
+    else
+    {
+        // Spectrum of every direction over the band
+        setDenseGrid();
+        handleSpectrum(used_band.lower_bin, used_band.upper_bin, audio);
+
+        // FFT Collapse
+        // cout << "Collapsing FFT\n";
+        fft_collapse_time.start();
+        FFTCollapse(used_band, post_process_type, band_scale);
+        fft_collapse_time.end();
+    }
+
+    process_time.end();
+
+#ifdef PRINT_FFT_COLLAPSE
+    data_fft_collapse.print();
 #endif
 
     // Final output
@@ -612,16 +2278,226 @@ void beamform::processData(cv::Mat &data_output, const int lower_frequency, cons
     beamform_time.print_avg(AVG_SAMPLES);
     fft_time.print_avg(AVG_SAMPLES);
     fft_collapse_time.print_avg(AVG_SAMPLES);
-    post_process_time.print_avg(AVG_SAMPLES);
     if (beamform_time.getCurrentAvgCount() > AVG_SAMPLES - 1)
     {
         cout << "\n";
     }
 
-// float total_time = beamform_time.time() + fft_time.time() + fft_collapse_time.time() + post_process_time.time();
+// float total_time = beamform_time.time() + fft_time.time() + fft_collapse_time.time();
 // cout << "Total Time: " << total_time << " ms.\n\n";
 #endif
 
 } // end processData
 
+//=====================================================================================
+
+/*
+    Band cube: the spectrum is computed once over every third octave band (bins 1 to 379 at
+    1024 / 48 kHz) and each band is collapsed from it, so switching bands in the UI only
+    changes which layer is shown. Output is (NUM_THIRD_OCTAVE_BANDS, theta, phi), 25 * 21 * 19
+    floats = 39.9 kB, against 1.6 kB for a single band map.
+
+    Cost per frame against the 1 kHz third octave (bins 19 to 24), default grid, one thread on x86:
+    - ENGINE_TIME_DOMAIN: same delay-and-sum (2.4 ms) and one batched FFT instead of Goertzel,
+      so the cube is close to free and the better choice for this engine.
+    - Per-bin steering scales with the bin count: frequency domain 0.28 -> 11.8 ms,
+      separable 0.12 -> 7.8 ms. Use single band mode with these engines on the Pi.
+    - Collapse: 0.015 -> 0.46 ms (25 log10 per direction instead of one).
+*/
+void beamform::processData(array3D<float> &data_output, const bands &band_table, const uint8_t post_process_type, const audio_view &audio)
+{
+    if (post_process_type >= NUM_POST_PROCESSING)
+    {
+        cerr << "Invalid post processing type.\n";
+        return;
+    }
+
+    if (data_output.dim_1 != NUM_THIRD_OCTAVE_BANDS || data_output.dim_2 != num_theta || data_output.dim_3 != num_phi)
+    {
+        cerr << "Band cube must be (NUM_THIRD_OCTAVE_BANDS, theta, phi).\n";
+        return;
+    }
+
+    if (!checkBuffers(audio))
+    {
+        return;
+    }
+
+    process_time.start();
+
+    // Spectrum of every direction over all third octave bands (the cube always uses the full grid)
+    setDenseGrid();
+    handleSpectrum(band_table.third(0).lower_bin, band_table.third(NUM_THIRD_OCTAVE_BANDS - 1).upper_bin, audio);
+
+    // Collapse every band
+    fft_collapse_time.start();
+    FFTCollapseCube(data_output, band_table, post_process_type);
+    fft_collapse_time.end();
+
+    process_time.end();
+
+// Profiling
+#ifdef PROFILE_BEAMFORM
+    beamform_time.print_avg(AVG_SAMPLES);
+    fft_time.print_avg(AVG_SAMPLES);
+    fft_collapse_time.print_avg(AVG_SAMPLES);
+    if (beamform_time.getCurrentAvgCount() > AVG_SAMPLES - 1)
+    {
+        cout << "\n";
+    }
+#endif
+
+} // end processData
+
+//=====================================================================================
+
+void beamform::setKernel(const uint8_t kernel_type)
+{
+    if (kernel_type >= NUM_BEAMFORM_KERNELS)
+    {
+        cerr << "Invalid beamforming kernel.\n";
+        return;
+    }
+
+    this->kernel_type = kernel_type;
+} // end setKernel
+
+//=====================================================================================
+
+void beamform::setEngine(const uint8_t engine_type)
+{
+    if (engine_type >= NUM_BEAMFORM_ENGINES)
+    {
+        cerr << "Invalid beamforming engine.\n";
+        return;
+    }
+
+    // Called every frame from the config, so only a new choice is applied (and reported)
+    if (engine_type == requested_engine)
+    {
+        return;
+    }
+
+    requested_engine = engine_type;
+    applyEngine();
+} // end setEngine
+
+//=====================================================================================
+
+void beamform::applyEngine()
+{
+    uint8_t engine = requested_engine;
+
+    // Both assume d(m, n) = d(0, 0) + m * a + n * b
+    if ((engine == ENGINE_SPATIAL_FFT || engine == ENGINE_SEPARABLE) && !uniform_grid)
+    {
+        cerr << "Geometry is not a uniform grid, using the frequency domain engine.\n";
+        engine = ENGINE_FREQUENCY_DOMAIN;
+    }
+
+    // Reads before the start of the window otherwise
+    if (engine == ENGINE_TIME_DOMAIN && !delays_fit)
+    {
+        cerr << "Delays do not fit in one window, using the frequency domain engine.\n";
+        engine = ENGINE_FREQUENCY_DOMAIN;
+    }
+
+    // Start the CSM history fresh so stale blocks are not averaged in
+    if (engine == ENGINE_CSM && engine_type != ENGINE_CSM)
+    {
+        cross_spectra.reset();
+        csm_next_start = fft_size;
+    }
+
+    engine_type = engine;
+} // end applyEngine
+
+//=====================================================================================
+
+void beamform::setQuality(const int quality)
+{
+    if (quality < 1 || quality > 3)
+    {
+        cerr << "Invalid quality: " << quality << "\n";
+        return;
+    }
+
+    this->quality = quality;
+} // end setQuality
+
+//=====================================================================================
+
+void beamform::setMaxBandBins(const int max_band_bins)
+{
+    this->max_band_bins = max(max_band_bins, 0);
+} // end setMaxBandBins
+
+//=====================================================================================
+
+void beamform::setCSMBlocks(const int csm_blocks)
+{
+    csm_max_blocks = max(csm_blocks, 0);
+} // end setCSMBlocks
+
+//=====================================================================================
+
+void beamform::setSpeedOfSound(const float speed_of_sound)
+{
+    if (speed_of_sound <= 0.0f)
+    {
+        cerr << "Invalid speed of sound: " << speed_of_sound << "\n";
+        return;
+    }
+
+    // Compared against the last applied value, so a slow drift is still picked up once it adds up
+    const float ratio = this->speed_of_sound / speed_of_sound;
+    if (fabsf(ratio - 1.0f) < SPEED_OF_SOUND_TOLERANCE)
+    {
+        return;
+    }
+
+    this->speed_of_sound = speed_of_sound;
+    params.speed_of_sound = speed_of_sound; // A rebuild from getParams() keeps it
+    rescaleDelays();
+} // end setSpeedOfSound
+
+//=====================================================================================
+
+int beamform::windowFrames() const
+{
+    return 2 * fft_size;
+} // end windowFrames
+
+//=====================================================================================
+
+double beamform::getProcessTime()
+{
+    return process_time.time();
+} // end getProcessTime
+
+double beamform::getSteeringTime()
+{
+    return beamform_time.time();
+} // end getSteeringTime
+
+//=====================================================================================
+
+const beamform_params &beamform::getParams() const
+{
+    return params;
+} // end getParams
+
+//=====================================================================================
+
+void beamform::setThreads(const int num_threads)
+{
+    this->num_threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+
+    // Reallocate scratch if the FFT has already been set up (the batched plan keeps the count it was planned with)
+    if (!thread_fft_input.empty())
+    {
+        setupThreadBuffers();
+    }
+} // end setThreads
+
 //=====================================================================================
\ No newline at end of file
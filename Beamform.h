@@ -3,6 +3,9 @@
 // Libraries
 #include <iostream>
 #include <complex>            // Complex numbers
+#include <vector>             // Steering tables
+#include <cmath>              // sinf
+#include <algorithm>          // find
 #include <fftw3.h>            // FFT  
 #include <opencv2/opencv.hpp> // For outputting cv::Mat
 
@@ -33,21 +36,25 @@ public:
 
 private:
     // Setup functions
-    void setupDirectivity(); // Computes directivity factor for phased array
-    void setupFFT();         // Creates FFT plan
+    void setupDirectivity();                                          // Maps every theta and phi onto a stored (or mirrored) angle
+    void setupSteering(const int lower_frequency, const int upper_frequency); // Steering factors for the active bins only
+    void setupFFT();                                                  // Creates FFT plan
 
     // Beamforming functions
-    void handleBeamforming(array3D<float> &data_input, const uint8_t lower_frequency, const uint8_t upper_frequency);
+    void handleBeamforming(array3D<float> &data_input, const int lower_frequency, const int upper_frequency);
     void FFT();
-    void FFTCollapse(const uint8_t lower_frequency, const uint8_t upper_frequency);
+    void FFTCollapse(const int lower_frequency, const int upper_frequency);
 
     // Helper functions
     float degtorad(const float angle_deg);            // Converts degrees to radians
     cv::Mat array2DtoMat(const array2D<float> &data); // Converts array2D to cv::Mat
+    complex<float> directivity(const int theta, const int phi, const int m, const int n, const int bin); // Steering factor of one mic
 
     // Initial conditions
     int fft_size;     // Size of FFT in samples
     int sample_rate;  // Audio sample rate in Hz
+    int m_channels;   // Number of microphones in the M direction
+    int n_channels;   // Number of microphones in the N direction
 
     float mic_spacing;    // Distance between microphones in meters
     float speed_of_sound; // Speed of sound in meters per second
@@ -66,8 +73,26 @@ private:
     fftwf_complex *fft_input_buffer;  // 1D buffer for input
     fftwf_complex *fft_output_buffer; // 1D buffer for output
 
+    /*
+        Steering separates along the array: exp(-j * k * d * (m * sin(theta) + n * sin(phi))) is a row
+        factor (theta, m) times a column factor (phi, n). Factors are only kept for the bins of the
+        active band and are generated by rotating one bin step at a time. sin is odd, so on a grid
+        symmetric around 0 the negative angles are the conjugates of the positive ones and are not
+        stored. Default grid: 4 kB for the 1 kHz third octave, 344 kB for every bin, against 52 MB
+        for the full (theta, phi, m, n, bin) table.
+    */
+    int lower_bin;                            // First bin in the steering tables (-1 = not built)
+    int upper_bin;                            // Last bin in the steering tables
+    vector<int> theta_source;                 // (theta) stored row of every theta
+    vector<bool> theta_mirrored;              // (theta) use the conjugate of the stored row
+    vector<int> phi_source;                   // (phi) stored row of every phi
+    vector<bool> phi_mirrored;                // (phi) use the conjugate of the stored row
+    vector<float> stored_theta;               // (stored theta) angle in degrees
+    vector<float> stored_phi;                 // (stored phi) angle in degrees
+    vector<complex<float>> theta_steering;    // (bin, stored theta, m) row factors
+    vector<complex<float>> phi_steering;      // (bin, stored phi, n) column factors
+
     // Arrays
-    array5D<complex<float>> directivity_factor; // (theta, phi, m, n, bin)
     array3D<complex<float>> data_beamform;      // (theta, phi, buffer) need to add bin dim later
     array3D<float> data_fft;                    // (theta, phi, bin)
     array2D<float> data_fft_collapse;           // (theta, phi)
@@ -88,6 +113,8 @@ beamform::beamform(const int fft_size, const int sample_rate, const int m_channe
     // Assign values to variables
     fft_size(fft_size),
     sample_rate(sample_rate),
+    m_channels(m_channels),
+    n_channels(n_channels),
 
     mic_spacing(mic_spacing),
     speed_of_sound(speed_of_sound),
@@ -107,10 +134,13 @@ beamform::beamform(const int fft_size, const int sample_rate, const int m_channe
     fft_collapse_time("FFT Collapse"),
     post_process_time("Post Process"),
 
+    // Steering tables are built for the first band
+    lower_bin(-1),
+    upper_bin(-1),
+
     // Allocate memory to arrays
-    directivity_factor(num_theta, num_phi, m_channels, n_channels, fft_size),
     data_beamform(num_theta, num_phi, fft_size),
-    data_fft(m_channels, n_channels, fft_size),
+    data_fft(num_theta, num_phi, fft_size),
     data_fft_collapse(num_theta, num_phi)
     {} // end beamform
 
@@ -119,6 +149,8 @@ beamform::~beamform()
 {
     // Free FFTW plan
     fftwf_destroy_plan(fft_plan);
+    fftwf_free(fft_input_buffer);
+    fftwf_free(fft_output_buffer);
 } // end ~beamform
 
 //=====================================================================================
@@ -143,26 +175,102 @@ cv::Mat beamform::array2DtoMat(const array2D<float> &data)
 
 void beamform::setupDirectivity()
 {
-    // Precompute directivity factor for all angles
-    for (int theta = min_theta, theta_index = 0; theta_index < directivity_factor.dim_1; theta += step_theta, theta_index++)
+    // An angle reuses the row of its negative if that one is already stored
+    theta_source.assign(num_theta, 0);
+    theta_mirrored.assign(num_theta, false);
+    stored_theta.clear();
+    for (int theta = min_theta, theta_index = 0; theta_index < num_theta; theta += step_theta, theta_index++)
+    {
+        auto mirror = find(stored_theta.begin(), stored_theta.end(), static_cast<float>(-theta));
+        if (theta != 0 && mirror != stored_theta.end())
+        {
+            theta_source[theta_index] = mirror - stored_theta.begin();
+            theta_mirrored[theta_index] = true;
+        }
+        else
+        {
+            theta_source[theta_index] = stored_theta.size();
+            stored_theta.push_back(theta);
+        }
+    } // end theta
+
+    phi_source.assign(num_phi, 0);
+    phi_mirrored.assign(num_phi, false);
+    stored_phi.clear();
+    for (int phi = min_phi, phi_index = 0; phi_index < num_phi; phi += step_phi, phi_index++)
     {
-        for (int phi = min_phi, phi_index = 0; phi_index < directivity_factor.dim_2; phi += step_phi, phi_index++)
+        auto mirror = find(stored_phi.begin(), stored_phi.end(), static_cast<float>(-phi));
+        if (phi != 0 && mirror != stored_phi.end())
+        {
+            phi_source[phi_index] = mirror - stored_phi.begin();
+            phi_mirrored[phi_index] = true;
+        }
+        else
         {
-            for (int m = 0; m < directivity_factor.dim_3; m++)
+            phi_source[phi_index] = stored_phi.size();
+            stored_phi.push_back(phi);
+        }
+    } // end phi
+} // end setupDirectivity
+
+void beamform::setupSteering(const int lower_frequency, const int upper_frequency)
+{
+    if (lower_frequency == lower_bin && upper_frequency == upper_bin)
+    {
+        return; // Band has not changed
+    }
+
+    lower_bin = lower_frequency;
+    upper_bin = upper_frequency;
+    const int num_bins = upper_bin - lower_bin + 1;
+    const int num_stored_theta = stored_theta.size();
+    const int num_stored_phi = stored_phi.size();
+
+    // Phase of one mic step at bin 1 is -2pi * (fs / fft_size) / c * d * sin(angle)
+    const float bin_phase = -2.0f * M_PI * (static_cast<float>(sample_rate) / fft_size) / speed_of_sound * mic_spacing;
+
+    theta_steering.resize(num_bins * num_stored_theta * m_channels);
+    for (int theta = 0; theta < num_stored_theta; theta++)
+    {
+        for (int m = 0; m < m_channels; m++)
+        {
+            // Rotate from bin to bin instead of calling polar for every one
+            float phase = bin_phase * m * sinf(degtorad(stored_theta[theta]));
+            complex<float> value = polar(1.0f, phase * lower_bin);
+            const complex<float> step = polar(1.0f, phase);
+            for (int bin = 0; bin < num_bins; bin++)
             {
-                for (int n = 0; n < directivity_factor.dim_4; n++)
-                {
-                    for (int bin = 0; bin < directivity_factor.dim_5; bin++)
-                    {
-                        float frequency = (sample_rate * bin) / fft_size;
-                        float wave_number = (2 * M_PI * frequency) / speed_of_sound; 
-                        float exponent = -wave_number * mic_spacing * (m * sinf(degtorad(theta)) + n * sinf(degtorad(phi)));
-                        directivity_factor.at(theta_index, phi_index, m, n, bin) = polar(1.0f, exponent);
-                    } // end b
-                } // end n
-            } // end m
-        } // end phi
+                theta_steering[(bin * num_stored_theta + theta) * m_channels + m] = value;
+                value *= step;
+            } // end bin
+        } // end m
     } // end theta
+
+    phi_steering.resize(num_bins * num_stored_phi * n_channels);
+    for (int phi = 0; phi < num_stored_phi; phi++)
+    {
+        for (int n = 0; n < n_channels; n++)
+        {
+            float phase = bin_phase * n * sinf(degtorad(stored_phi[phi]));
+            complex<float> value = polar(1.0f, phase * lower_bin);
+            const complex<float> step = polar(1.0f, phase);
+            for (int bin = 0; bin < num_bins; bin++)
+            {
+                phi_steering[(bin * num_stored_phi + phi) * n_channels + n] = value;
+                value *= step;
+            } // end bin
+        } // end n
+    } // end phi
+} // end setupSteering
+
+complex<float> beamform::directivity(const int theta, const int phi, const int m, const int n, const int bin)
+{
+    const int bin_index = bin - lower_bin;
+    complex<float> row = theta_steering[(bin_index * stored_theta.size() + theta_source[theta]) * m_channels + m];
+    complex<float> column = phi_steering[(bin_index * stored_phi.size() + phi_source[phi]) * n_channels + n];
+    if (theta_mirrored[theta]) {row = conj(row);}
+    if (phi_mirrored[phi]) {column = conj(column);}
+    return row * column;
 } // end directivity
 
 void beamform::setupFFT()
@@ -183,18 +291,28 @@ void beamform::setup()
 
 //=====================================================================================
 
-void beamform::handleBeamforming(array3D<float> &data_input, const uint8_t lower_frequency, const uint8_t upper_frequency)
+void beamform::handleBeamforming(array3D<float> &data_input, const int lower_frequency, const int upper_frequency)
 {
+    // Narrowband: every direction is steered at the center of the band
+    const int center_bin = (lower_frequency + upper_frequency) / 2;
+    setupSteering(lower_frequency, upper_frequency);
+
     for (int theta = 0; theta < data_beamform.dim_1; theta++)
     {
         for (int phi = 0; phi < data_beamform.dim_2; phi++)
         {
-            for (int m = 0; m < data_input.dim_1; m++)
+            // Clear the previous frame
+            for (int b = 0; b < data_beamform.dim_3; b++)
+            {
+                data_beamform.at(theta, phi, b) = 0.0f;
+            } // end b
+
+            for (int m = 0; m < m_channels; m++)
             {
-                for (int n = 0; n < data_input.dim_2; n++)
+                for (int n = 0; n < n_channels; n++)
                 {
                     // Cache the directivity factor
-                    complex<float> directivity = directivity_factor.at(theta, phi, m, n, 21); // 984Hz
+                    complex<float> directivity = this->directivity(theta, phi, m, n, center_bin);
                     for (int b = 0; b < data_input.dim_3; b++)
                     {
                         // Calculate and sum correlated samples
@@ -239,7 +357,7 @@ void beamform::FFT()
 
 //=====================================================================================
 
-void beamform::FFTCollapse(const uint8_t lower_frequency, const uint8_t upper_frequency)
+void beamform::FFTCollapse(const int lower_frequency, const int upper_frequency)
 {
     // dB addition
     for (int theta = 0; theta < data_fft.dim_1; theta++)
@@ -263,5 +381,24 @@ void beamform::FFTCollapse(const uint8_t lower_frequency, const uint8_t upper_fr
 void beamform::processData(cv::Mat &data_output, const int lower_frequency, const int upper_frequency,
                            array3D<float> &data_buffer_1, array3D<float> &data_buffer_2)
 {
+    if (lower_frequency < 0 || upper_frequency >= fft_size || lower_frequency > upper_frequency)
+    {
+        cerr << "Invalid band: bins " << lower_frequency << " to " << upper_frequency << "\n";
+        return;
+    }
+
+    // Newest buffer only
+    beamform_time.start();
+    handleBeamforming(data_buffer_2, lower_frequency, upper_frequency);
+    beamform_time.end();
+
+    fft_time.start();
+    FFT();
+    fft_time.end();
+
+    fft_collapse_time.start();
+    FFTCollapse(lower_frequency, upper_frequency);
+    fft_collapse_time.end();
 
+    data_output = array2DtoMat(data_fft_collapse);
 } // end processData
\ No newline at end of file
@@ -0,0 +1,183 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Headers
+#include "PARAMS.h"
+
+using namespace std;
+
+// Settings the frame budget controller can trade for speed
+struct operating_point
+{
+    int quality;       // Search quality (1 to 3), capped by the Quality slider
+    int max_band_bins; // Bins integrated per band (0 = all)
+    int csm_blocks;    // Welch blocks per frame for ENGINE_CSM (0 = all)
+    bool band_cube;    // Third octave band cube allowed
+};
+
+// Cheapest last. Every step removes work from whichever engine is active
+const operating_point BUDGET_LADDER[] =
+{
+    {3, 0,  0, true},  // Full grid, every band
+    {3, 0,  0, false}, // Full grid, selected band only
+    {2, 0,  0, false}, // Hierarchical to full resolution
+    {2, 0,  1, false}, // One CSM block per frame
+    {1, 16, 1, false}, // Hierarchical to stride 2, 16 bins per band
+    {1, 4,  1, false}  // 4 bins per band
+};
+const int NUM_BUDGET_LEVELS = sizeof(BUDGET_LADDER) / sizeof(BUDGET_LADDER[0]);
+
+/*
+    Holds the frame rate at target_fps by moving along BUDGET_LADDER. Frame and beamform
+    times are smoothed; a step down needs the frame to be over budget by BUDGET_HYSTERESIS
+    for BUDGET_HOLD_FRAMES frames with beamforming taking at least BUDGET_MIN_SHARE of it
+    (otherwise the camera or UI is the bottleneck and degrading the map would not help).
+    A step up needs the same margin under budget, and the last time measured at the level
+    above has to fit, so the controller does not bounce between two levels. That time is
+    retried after BUDGET_PROBE_FACTOR holds in case it was measured while throttled.
+*/
+class budget
+{
+public:
+    // Constructor
+    budget(const float target_fps);
+
+    // Feeds one frame, times in ms. Returns true if the operating point changed
+    bool update(const double frame_time, const double process_time);
+
+    // Current operating point
+    const operating_point &current() const;
+
+    // Index into BUDGET_LADDER
+    int getLevel();
+
+    // Short description for the UI
+    string describe();
+
+    // Goes back to the top of the ladder
+    void reset();
+
+private:
+    float target_time; // Frame budget in ms
+
+    int level;              // Index into BUDGET_LADDER
+    int hold_counter;       // Frames the current condition has held (negative = under budget)
+    double frame_average;   // Smoothed frame time in ms
+    double process_average; // Smoothed beamform time in ms
+    vector<double> level_process_time; // (level) smoothed beamform time last seen at each level, 0 = not measured
+};
+
+budget::budget(const float target_fps) : target_time(1000.0f / target_fps),
+                                         level(0),
+                                         hold_counter(0),
+                                         frame_average(0.0),
+                                         process_average(0.0),
+                                         level_process_time(NUM_BUDGET_LEVELS, 0.0)
+{
+}
+
+//=====================================================================================
+
+void budget::reset()
+{
+    level = 0;
+    hold_counter = 0;
+    frame_average = 0.0;
+    process_average = 0.0;
+    fill(level_process_time.begin(), level_process_time.end(), 0.0);
+} // end reset
+
+//=====================================================================================
+
+bool budget::update(const double frame_time, const double process_time)
+{
+    // Smooth both times, the first frame seeds the averages
+    if (frame_average == 0.0)
+    {
+        frame_average = frame_time;
+        process_average = process_time;
+    }
+    frame_average += BUDGET_SMOOTHING * (frame_time - frame_average);
+    process_average += BUDGET_SMOOTHING * (process_time - process_average);
+    level_process_time[level] = process_average;
+
+    bool over_budget = frame_average > target_time * (1.0f + BUDGET_HYSTERESIS) &&
+                       process_average >= BUDGET_MIN_SHARE * frame_average &&
+                       level < NUM_BUDGET_LEVELS - 1;
+
+    bool under_budget = frame_average < target_time * (1.0f - BUDGET_HYSTERESIS) && level > 0;
+
+    // Frame time with the beamform time of the level above swapped in
+    bool level_above_fits = false;
+    if (under_budget)
+    {
+        double predicted = frame_average - process_average + level_process_time[level - 1];
+        level_above_fits = predicted < target_time;
+    }
+
+    if (over_budget)
+    {
+        hold_counter = max(hold_counter, 0) + 1;
+    }
+    else if (under_budget)
+    {
+        hold_counter = min(hold_counter, 0) - 1;
+    }
+    else
+    {
+        hold_counter = 0;
+    }
+
+    if (hold_counter >= BUDGET_HOLD_FRAMES)
+    {
+        level++;
+    }
+    else if ((hold_counter <= -BUDGET_HOLD_FRAMES && level_above_fits) || hold_counter <= -BUDGET_HOLD_FRAMES * BUDGET_PROBE_FACTOR)
+    {
+        level--; // Time at the level above may be stale (e.g. measured while throttled), so retry after a long hold
+    }
+    else
+    {
+        return false;
+    }
+
+    // New level starts from the current averages
+    hold_counter = 0;
+    return true;
+} // end update
+
+//=====================================================================================
+
+const operating_point &budget::current() const
+{
+    return BUDGET_LADDER[level];
+} // end current
+
+//=====================================================================================
+
+int budget::getLevel()
+{
+    return level;
+} // end getLevel
+
+//=====================================================================================
+
+string budget::describe()
+{
+    const operating_point &point = current();
+
+    string text = "L" + to_string(level) + " Q" + to_string(point.quality);
+    text += (point.max_band_bins > 0) ? " " + to_string(point.max_band_bins) + " bins" : " all bins";
+    if (point.csm_blocks > 0)
+    {
+        text += " " + to_string(point.csm_blocks) + " blk";
+    }
+    return text;
+} // end describe
+
+//=====================================================================================
@@ -0,0 +1,240 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <complex>
+#include <algorithm>
+
+// Headers
+#include "PARAMS.h"
+#include "Structs.h"
+
+using namespace std;
+
+/*
+    Cross-spectral matrix C(b) = E[X(b) X(b)^H] per FFT bin, built from one spectrum per
+    channel per block (snapshot). C is Hermitian, so only the upper triangle is kept, packed
+    row by row: (0,0) (0,1) ... (0,C-1) (1,1) ... (C-1,C-1), C * (C + 1) / 2 pairs per bin.
+
+    Averaging is either a moving average over the last num_averages snapshots (rank-1 add of
+    the new snapshot, rank-1 subtract of the one leaving the ring) or, with a forget factor
+    l > 0, exponential: C = l * C + (1 - l) * x * x^H. The moving sum is rebuilt from the ring
+    every time it wraps so float round-off from add/subtract cannot build up.
+*/
+class csm
+{
+public:
+    // Constructor
+    csm(const int num_channels, const int num_bins, const int num_averages, const float forget_factor);
+
+    // Clears the matrix and snapshot history
+    void reset();
+
+    // Adds one snapshot, spectra is (channel, bin)
+    void addSnapshot(const array2D<complex<float>> &spectra);
+
+    // Steered power w^H C w for one bin, steering[c] = exp(-j * 2pi * b * d / fft_size) per channel
+    float power(const int bin, const complex<float> *steering) const;
+
+    // Removes the auto-spectra (self-noise of each mic) from power()
+    void setDiagonalRemoval(const bool remove_diagonal);
+
+    // Index of (row, column), row <= column, in the packed upper triangle
+    int pairIndex(const int row, const int column) const;
+
+    // Number of snapshots currently averaged
+    int getSnapshotCount();
+
+private:
+    // matrix += scale * x * x^H for every bin
+    void accumulate(const complex<float> *spectra, const float scale);
+
+    // Recomputes the moving sum from the snapshot ring
+    void rebuild();
+
+    int num_channels;    // Number of microphones
+    int num_bins;        // Bins per spectrum
+    int num_pairs;       // Upper triangle entries per bin
+    int num_averages;    // Snapshots in the moving average
+    float forget_factor; // Exponential forget factor (0 = moving average)
+    bool remove_diagonal;
+
+    array2D<complex<float>> matrix;    // (bin, pair) moving sum, or exponential average
+    array3D<complex<float>> snapshots; // (average, channel, bin) ring of past snapshots
+    int snapshot_index;                // Next slot in the ring
+    int snapshot_count;                // Valid slots in the ring
+};
+
+csm::csm(const int num_channels, const int num_bins, const int num_averages, const float forget_factor) : num_channels(num_channels),
+                                                                                                          num_bins(num_bins),
+                                                                                                          num_pairs(num_channels * (num_channels + 1) / 2),
+                                                                                                          num_averages(max(1, num_averages)),
+                                                                                                          forget_factor(forget_factor),
+                                                                                                          remove_diagonal(CSM_REMOVE_DIAGONAL),
+                                                                                                          matrix(num_bins, num_channels * (num_channels + 1) / 2),
+                                                                                                          snapshots((forget_factor > 0.0f) ? 1 : max(1, num_averages), num_channels, num_bins),
+                                                                                                          snapshot_index(0),
+                                                                                                          snapshot_count(0)
+{
+}
+
+//=====================================================================================
+
+void csm::reset()
+{
+    fill(matrix.data, matrix.data + matrix.dim_1 * matrix.dim_2, complex<float>(0.0f, 0.0f));
+    snapshot_index = 0;
+    snapshot_count = 0;
+} // end reset
+
+//=====================================================================================
+
+int csm::pairIndex(const int row, const int column) const
+{
+    return row * num_channels - (row * (row - 1)) / 2 + (column - row);
+} // end pairIndex
+
+//=====================================================================================
+
+void csm::accumulate(const complex<float> *spectra, const float scale)
+{
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < num_bins; b++)
+    {
+        complex<float> *entry = &matrix.at(b, 0);
+
+        for (int row = 0; row < num_channels; row++)
+        {
+            const complex<float> x_row = spectra[row * num_bins + b] * scale;
+            for (int column = row; column < num_channels; column++)
+            {
+                *entry++ += x_row * conj(spectra[column * num_bins + b]);
+            } // end column
+        } // end row
+    } // end b
+} // end accumulate
+
+//=====================================================================================
+
+void csm::rebuild()
+{
+    fill(matrix.data, matrix.data + matrix.dim_1 * matrix.dim_2, complex<float>(0.0f, 0.0f));
+
+    for (int average = 0; average < snapshot_count; average++)
+    {
+        accumulate(&snapshots.at(average, 0, 0), 1.0f);
+    } // end average
+} // end rebuild
+
+//=====================================================================================
+
+void csm::addSnapshot(const array2D<complex<float>> &spectra)
+{
+    if (spectra.dim_1 != num_channels || spectra.dim_2 != num_bins)
+    {
+        cerr << "CSM snapshot must be (channel, bin).\n";
+        return;
+    }
+
+    // Exponential average, no history needed
+    if (forget_factor > 0.0f)
+    {
+        if (snapshot_count == 0)
+        {
+            accumulate(spectra.data, 1.0f); // First snapshot seeds the average
+            snapshot_count = 1;
+            return;
+        }
+
+        for (int i = 0; i < matrix.dim_1 * matrix.dim_2; i++)
+        {
+            matrix.data[i] *= forget_factor;
+        } // end i
+        accumulate(spectra.data, 1.0f - forget_factor);
+        return;
+    }
+
+    // Moving average: drop the snapshot leaving the ring, add the new one
+    complex<float> *slot = &snapshots.at(snapshot_index, 0, 0);
+    if (snapshot_count == num_averages)
+    {
+        accumulate(slot, -1.0f);
+    }
+    copy(spectra.data, spectra.data + num_channels * num_bins, slot);
+    snapshot_count = min(snapshot_count + 1, num_averages);
+    snapshot_index = (snapshot_index + 1) % num_averages;
+
+    if (snapshot_index == 0)
+    {
+        rebuild();
+    }
+    else
+    {
+        accumulate(slot, 1.0f);
+    }
+} // end addSnapshot
+
+//=====================================================================================
+
+/*
+    |Y|^2 = sum over (i, j) of s_i * C_ij * conj(s_j). The diagonal is real and the lower
+    triangle is the conjugate of the upper, so this is sum C_ii + 2 * Re(sum over i < j).
+    Normalized by num_channels^2 (num_channels^2 - num_channels without the diagonal) so the
+    level matches the other engines. Removing the diagonal can give small negative values,
+    which are clamped.
+*/
+float csm::power(const int bin, const complex<float> *steering) const
+{
+    if (snapshot_count == 0)
+    {
+        return CSM_MIN_POWER;
+    }
+
+    const complex<float> *entry = &matrix.at(bin, 0);
+
+    float diagonal = 0.0f;
+    complex<float> cross(0.0f, 0.0f);
+    for (int row = 0; row < num_channels; row++)
+    {
+        diagonal += real(*entry++);
+
+        complex<float> row_sum(0.0f, 0.0f);
+        for (int column = row + 1; column < num_channels; column++)
+        {
+            row_sum += *entry++ * conj(steering[column]);
+        } // end column
+        cross += steering[row] * row_sum;
+    } // end row
+
+    float result = 2.0f * real(cross);
+    float normalization = static_cast<float>(num_channels * num_channels - num_channels);
+    if (!remove_diagonal)
+    {
+        result += diagonal;
+        normalization = static_cast<float>(num_channels * num_channels);
+    }
+
+    // Moving sum to average
+    if (forget_factor <= 0.0f)
+    {
+        normalization *= snapshot_count;
+    }
+
+    return max(result / normalization, CSM_MIN_POWER);
+} // end power
+
+//=====================================================================================
+
+void csm::setDiagonalRemoval(const bool remove_diagonal)
+{
+    this->remove_diagonal = remove_diagonal;
+} // end setDiagonalRemoval
+
+//=====================================================================================
+
+int csm::getSnapshotCount()
+{
+    return snapshot_count;
+} // end getSnapshotCount
+
+//=====================================================================================
@@ -0,0 +1,154 @@
+#pragma once
+
+// Libraries
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h> // AVX2 intrinsics
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>  // NEON intrinsics
+#endif
+
+// Headers
+#include "PARAMS.h"
+
+using namespace std;
+
+const float S32_SCALE = 1.0f / 2147483648.0f; // Full scale S32 to (-1, 1)
+const int CONVERT_TILE_FRAMES = 64;           // Frames per tile, 64 x 16 channels x 4 bytes = 4 kB of input stays in L1
+
+/*
+    Layout of each sample format. Integer samples are loaded as a little endian word and
+    shifted up to the top of an int32, so every integer format shares the S32 scale (2^31)
+    and whatever is above the sample bits (S24 in 4 bytes) falls off.
+*/
+template <sample_format FORMAT> struct sample_layout;
+template <> struct sample_layout<SAMPLE_S32>   {static const int bytes = 4; static const int shift = 0;  static const bool is_float = false;};
+template <> struct sample_layout<SAMPLE_FLOAT> {static const int bytes = 4; static const int shift = 0;  static const bool is_float = true;};
+template <> struct sample_layout<SAMPLE_S24>   {static const int bytes = 4; static const int shift = 8;  static const bool is_float = false;};
+template <> struct sample_layout<SAMPLE_S24_3> {static const int bytes = 3; static const int shift = 8;  static const bool is_float = false;};
+template <> struct sample_layout<SAMPLE_S16>   {static const int bytes = 2; static const int shift = 16; static const bool is_float = false;};
+
+// Little endian sample bits at p (a 3 byte memcpy is a library call, so those are assembled)
+template <sample_format FORMAT>
+inline uint32_t loadWord(const uint8_t *p)
+{
+    typedef sample_layout<FORMAT> layout;
+    if constexpr (layout::bytes == 3)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+    else
+    {
+        uint32_t word = 0;
+        memcpy(&word, p, layout::bytes);
+        return word;
+    }
+} // end loadWord
+
+// One sample at p as a float in (-1, 1)
+template <sample_format FORMAT>
+inline float loadSample(const uint8_t *p)
+{
+    typedef sample_layout<FORMAT> layout;
+    if constexpr (layout::is_float)
+    {
+        float sample;
+        memcpy(&sample, p, sizeof(sample));
+        return sample;
+    }
+    else
+    {
+        return static_cast<float>(static_cast<int32_t>(loadWord<FORMAT>(p) << layout::shift)) * S32_SCALE;
+    }
+} // end loadSample
+
+/*
+    Interleaved frames of FORMAT to channel planar floats in mic order, in one pass.
+    planar[c * planar_stride + b] = sample b of hardware channel channel_map[c], in (-1, 1),
+    for c < num_outputs and b < frames. Frames are done in tiles so every output channel
+    reads the same few kB of input; within a tile each channel is a strided gather of 4 byte
+    words (AVX2) or four lane loads and a fixed point convert (NEON, 31 fraction bits is the
+    2^31 scale). The format is a template parameter, so each loop is specialised and has no
+    per-sample branch.
+*/
+template <sample_format FORMAT>
+void convertSamples(const void *interleaved, const int frame_channels, const int frames,
+                    const int *channel_map, const int num_outputs, float *planar, const int planar_stride)
+{
+    typedef sample_layout<FORMAT> layout;
+    const int frame_bytes = frame_channels * layout::bytes;
+
+    for (int tile = 0; tile < frames; tile += CONVERT_TILE_FRAMES)
+    {
+        const int tile_end = min(tile + CONVERT_TILE_FRAMES, frames);
+
+        for (int c = 0; c < num_outputs; c++)
+        {
+            const uint8_t *input = static_cast<const uint8_t *>(interleaved) + channel_map[c] * layout::bytes;
+            float *output = planar + c * planar_stride;
+            int b = tile;
+
+            // A 4 byte word of the last sample in the buffer would read past its end (SIMD loops only)
+            [[maybe_unused]] const int vector_end = (layout::bytes < 4 && channel_map[c] == frame_channels - 1) ? min(tile_end, frames - 1) : tile_end;
+
+#if defined(__AVX2__)
+            const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(frame_bytes));
+            const __m256 scale = _mm256_set1_ps(S32_SCALE);
+            for (; b + 8 <= vector_end; b += 8)
+            {
+                __m256i words = _mm256_i32gather_epi32(reinterpret_cast<const int *>(input + b * frame_bytes), offsets, 1);
+                if constexpr (layout::is_float)
+                {
+                    _mm256_storeu_ps(output + b, _mm256_castsi256_ps(words));
+                }
+                else
+                {
+                    __m256i samples = _mm256_slli_epi32(words, layout::shift);
+                    _mm256_storeu_ps(output + b, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+                }
+            } // end b
+#elif defined(__ARM_NEON)
+            if constexpr (!layout::is_float)
+            {
+                for (; b + 4 <= vector_end; b += 4)
+                {
+                    const uint8_t *frame = input + b * frame_bytes;
+                    const uint32_t words[4] = {loadWord<FORMAT>(frame), loadWord<FORMAT>(frame + frame_bytes),
+                                               loadWord<FORMAT>(frame + 2 * frame_bytes), loadWord<FORMAT>(frame + 3 * frame_bytes)};
+                    int32x4_t samples = vshlq_n_s32(vreinterpretq_s32_u32(vld1q_u32(words)), layout::shift);
+                    vst1q_f32(output + b, vcvtq_n_f32_s32(samples, 31));
+                } // end b
+            }
+#endif
+
+            // Scalar tail (and whole tile when no SIMD is available)
+            for (; b < tile_end; b++)
+            {
+                output[b] = loadSample<FORMAT>(input + b * frame_bytes);
+            } // end b
+        } // end c
+    } // end tile
+} // end convertSamples
+
+// Converter for a format, picked once when the format is negotiated
+typedef void (*convert_kernel)(const void *, const int, const int, const int *, const int, float *, const int);
+
+convert_kernel convertKernel(const sample_format format)
+{
+    switch (format)
+    {
+    case SAMPLE_FLOAT:
+        return convertSamples<SAMPLE_FLOAT>;
+    case SAMPLE_S24:
+        return convertSamples<SAMPLE_S24>;
+    case SAMPLE_S24_3:
+        return convertSamples<SAMPLE_S24_3>;
+    case SAMPLE_S16:
+        return convertSamples<SAMPLE_S16>;
+    default:
+        return convertSamples<SAMPLE_S32>;
+    }
+} // end convertKernel
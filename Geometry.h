@@ -0,0 +1,268 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Headers
+#include "PARAMS.h"
+#include "Structs.h"
+
+using namespace std;
+
+// One microphone of the array
+struct microphone
+{
+    vec3<float> position; // Meters, array plane is z = 0 for the lattice
+    int channel;          // Hardware channel in the interleaved capture
+};
+
+/*
+    Microphone positions and hardware channels, laid out as (row, column) so the engines can
+    keep their (m, n) indexing. A lattice is rows x columns; a file without a grid line is a
+    single row of every mic in file order.
+
+    File format, one mic per line, '#' starts a comment:
+        grid 4 4                  (optional, mics follow row by row)
+        0.000 0.000 0.000 10      (x y z in meters, hardware channel)
+*/
+class geometry
+{
+public:
+    // Empty array
+    geometry();
+
+    // rows x columns lattice at spacing meters, channels from CHANNEL_ORDER where it covers the lattice and after its highest elsewhere
+    geometry(const int rows, const int columns, const float spacing);
+
+    // Reads a geometry file, keeps the current array on failure
+    bool load(const string &filename);
+
+    // Microphone at (row, column) of the layout
+    const microphone &at(const int row, const int column) const;
+
+    // Rows of the layout
+    int getRows() const;
+
+    // Columns of the layout
+    int getColumns() const;
+
+    // Number of microphones
+    int numMics() const;
+
+    // Channels the capture has to deliver (highest hardware channel + 1)
+    int hardwareChannels() const;
+
+    // True if position(m, n) = position(0, 0) + m * a + n * b, which the spatial FFT and separable engines need
+    bool isUniform() const;
+
+    // Layout, channel range and extent for the log
+    void print() const;
+
+private:
+    int rows;                 // Rows of the layout
+    int columns;              // Columns of the layout
+    vector<microphone> mics;  // (row * columns + column)
+};
+
+geometry::geometry() : rows(0),
+                       columns(0)
+{
+}
+
+geometry::geometry(const int rows, const int columns, const float spacing) : rows(rows),
+                                                                              columns(columns),
+                                                                              mics(rows * columns)
+{
+    // Mics outside CHANNEL_ORDER continue after its highest channel, so no two mics share one
+    int next_channel = 0;
+    for (int m = 0; m < M_AMOUNT; m++)
+    {
+        for (int n = 0; n < N_AMOUNT; n++)
+        {
+            next_channel = max(next_channel, CHANNEL_ORDER[m][n] + 1);
+        } // end n
+    } // end m
+
+    for (int m = 0; m < rows; m++)
+    {
+        for (int n = 0; n < columns; n++)
+        {
+            microphone &mic = mics[m * columns + n];
+            mic.position.x = m * spacing;
+            mic.position.y = n * spacing;
+            mic.position.z = 0.0f;
+            mic.channel = (m < M_AMOUNT && n < N_AMOUNT) ? CHANNEL_ORDER[m][n] : next_channel++;
+        } // end n
+    } // end m
+}
+
+//=====================================================================================
+
+bool geometry::load(const string &filename)
+{
+    ifstream file(filename);
+    if (!file)
+    {
+        cerr << "Could not open geometry file: " << filename << "\n";
+        return false;
+    }
+
+    int grid_rows = 0;
+    int grid_columns = 0;
+    vector<microphone> loaded;
+
+    string line;
+    int line_number = 0;
+    while (getline(file, line))
+    {
+        line_number++;
+        line = line.substr(0, line.find('#')); // Strip comments
+
+        istringstream fields(line);
+        string first;
+        if (!(fields >> first))
+        {
+            continue; // Empty line
+        }
+
+        if (first == "grid")
+        {
+            if (!(fields >> grid_rows >> grid_columns) || grid_rows < 1 || grid_columns < 1)
+            {
+                cerr << filename << ":" << line_number << ": grid needs rows and columns\n";
+                return false;
+            }
+            continue;
+        }
+
+        microphone mic;
+        fields.clear();
+        fields.str(line);
+        if (!(fields >> mic.position.x >> mic.position.y >> mic.position.z >> mic.channel) || mic.channel < 0)
+        {
+            cerr << filename << ":" << line_number << ": expected x y z channel\n";
+            return false;
+        }
+        loaded.push_back(mic);
+    } // end line
+
+    if (loaded.empty())
+    {
+        cerr << filename << ": no microphones\n";
+        return false;
+    }
+
+    if (grid_rows > 0 && grid_rows * grid_columns != static_cast<int>(loaded.size()))
+    {
+        cerr << filename << ": grid " << grid_rows << "x" << grid_columns << " does not match " << loaded.size() << " microphones\n";
+        return false;
+    }
+
+    rows = (grid_rows > 0) ? grid_rows : 1;
+    columns = (grid_rows > 0) ? grid_columns : loaded.size();
+    mics = loaded;
+    return true;
+} // end load
+
+//=====================================================================================
+
+const microphone &geometry::at(const int row, const int column) const
+{
+    return mics[row * columns + column];
+} // end at
+
+//=====================================================================================
+
+int geometry::getRows() const
+{
+    return rows;
+} // end getRows
+
+int geometry::getColumns() const
+{
+    return columns;
+} // end getColumns
+
+int geometry::numMics() const
+{
+    return mics.size();
+} // end numMics
+
+int geometry::hardwareChannels() const
+{
+    int highest = -1;
+    for (const microphone &mic : mics)
+    {
+        highest = max(highest, mic.channel);
+    } // end mic
+    return highest + 1;
+} // end hardwareChannels
+
+//=====================================================================================
+
+bool geometry::isUniform() const
+{
+    if (mics.empty())
+    {
+        return false;
+    }
+
+    const float tolerance = 1e-4f; // Meters
+
+    const vec3<float> &origin = at(0, 0).position;
+    vec3<float> a = {0.0f, 0.0f, 0.0f}; // Step along rows
+    vec3<float> b = {0.0f, 0.0f, 0.0f}; // Step along columns
+    if (rows > 1)
+    {
+        a = {at(1, 0).position.x - origin.x, at(1, 0).position.y - origin.y, at(1, 0).position.z - origin.z};
+    }
+    if (columns > 1)
+    {
+        b = {at(0, 1).position.x - origin.x, at(0, 1).position.y - origin.y, at(0, 1).position.z - origin.z};
+    }
+
+    for (int m = 0; m < rows; m++)
+    {
+        for (int n = 0; n < columns; n++)
+        {
+            const vec3<float> &position = at(m, n).position;
+            if (fabsf(origin.x + m * a.x + n * b.x - position.x) > tolerance ||
+                fabsf(origin.y + m * a.y + n * b.y - position.y) > tolerance ||
+                fabsf(origin.z + m * a.z + n * b.z - position.z) > tolerance)
+            {
+                return false;
+            }
+        } // end n
+    } // end m
+
+    return true;
+} // end isUniform
+
+//=====================================================================================
+
+void geometry::print() const
+{
+    float extent = 0.0f;
+    for (const microphone &a : mics)
+    {
+        for (const microphone &b : mics)
+        {
+            float dx = a.position.x - b.position.x;
+            float dy = a.position.y - b.position.y;
+            float dz = a.position.z - b.position.z;
+            extent = max(extent, sqrtf(dx * dx + dy * dy + dz * dz));
+        } // end b
+    } // end a
+
+    cout << "Geometry: " << numMics() << " mics as " << rows << "x" << columns
+         << ", " << hardwareChannels() << " hardware channels, aperture " << extent << " m"
+         << (isUniform() ? ", uniform" : "") << "\n";
+} // end print
+
+//=====================================================================================
@@ -16,8 +16,13 @@ const int CHANNEL_ORDER[M_AMOUNT][N_AMOUNT] =
     {15, 13, 7, 5}
 };
 #define MIC_GAIN 1.0f
+#define GEOMETRY_FILE "" // Mic positions and hardware channels (see Geometry.h), "" = M_AMOUNT x N_AMOUNT lattice above
 
-// Angles
+// Speed of sound (follows the air temperature in Options at runtime)
+#define AIR_TEMPERATURE 20.0f             // Degrees Celsius, 343.2 m/s
+#define SPEED_OF_SOUND_TOLERANCE 0.0002f  // Relative change (~0.1 C) below which the delay tables are not rescaled
+
+// Angles (defaults, the grid can be changed at runtime in Options)
 #define MIN_THETA -30
 #define MAX_THETA  30
 #define STEP_THETA 3 // 2 is correct
@@ -36,13 +41,89 @@ const int NUM_PHI = ((MAX_PHI - MIN_PHI) / STEP_PHI) + 1;
 
 #define NUM_TAPS 5
 
+// Beamforming kernels
+enum beamform_kernel: uint8_t
+{
+    KERNEL_STK,  // Per-sample stk::DelayL per channel (reference for KERNEL_SIMD and A/B timing)
+    KERNEL_SIMD, // Vectorised linear interpolation over contiguous spans
+    NUM_BEAMFORM_KERNELS
+};
+#define BEAMFORM_KERNEL KERNEL_SIMD // Kernel used by default
+#define KERNEL_TOLERANCE_DB 1e-3f   // Largest map difference between the kernels on the same audio (checked by bench.cpp)
+
+// Beamforming engines
+enum beamform_engine: uint8_t
+{
+    ENGINE_TIME_DOMAIN,      // Delay-and-sum every direction, then one FFT per direction
+    ENGINE_FREQUENCY_DOMAIN, // One FFT per mic, steered per bin by phase
+    ENGINE_SPATIAL_FFT,      // One zero-padded 2D spatial FFT per bin, resampled onto the grid
+    ENGINE_SEPARABLE,        // Partial beams along M per row delay, combined along N per direction
+    ENGINE_CSM,              // Welch-averaged cross-spectral matrix, map is w^H C w per direction
+    NUM_BEAMFORM_ENGINES
+};
+#define BEAMFORM_ENGINE ENGINE_TIME_DOMAIN // Engine used by default
+#define SPATIAL_FFT_SIZE 32                // Zero-padded size of the spatial FFT (per side)
+#define SEPARABLE_RESOLUTION 64            // Row delay steps per sample when grouping directions
+#define BEAMFORM_THREADS 0                 // Worker threads for beamforming (0 = all cores, DSP_CPU_MASK ones with REALTIME_PROFILE)
+#define BEAMFORM_QUALITY 3                 // 1 and 2 search the grid coarse to fine, 3 evaluates every direction
+#define HIERARCHY_COARSE_STRIDE 4          // Grid stride of the first pass (power of 2)
+#define HIERARCHY_PEAKS 3                  // Peaks refined at every level
+
+// Cross-spectral matrix (ENGINE_CSM)
+#define CSM_OVERLAP 0.5f         // Overlap between Welch blocks (0 to < 1)
+#define CSM_AVERAGES 16          // Blocks in the moving average
+#define CSM_FORGET_FACTOR 0.0f   // Exponential averaging instead of the moving average when > 0 (e.g. 0.9)
+#define CSM_REMOVE_DIAGONAL true // Drop the auto-spectra to suppress uncorrelated mic self-noise
+#define CSM_MIN_POWER 1e-20f     // Floor for the steered power (diagonal removal can go negative)
+
 // FFT
-#define FFT_SIZE 1024                   // Amount of samples in one frame of the FFT
+#define FFT_SIZE 1024                   // Amount of samples in one frame of the FFT (default)
+#define FFTW_PLANNER FFTW_MEASURE       // FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT
+#define FFTW_WISDOM_DIR "wisdom"        // Saved FFTW plans, one file per CPU, FFT size and batch
+#define TABLE_CACHE_DIR "tables"        // Saved delay and steering tables, one file per array, grid and rate
+#define TABLE_CACHE_VERSION 1           // Bump when the table layout or delay convention changes
+#define GOERTZEL_MAX_BINS 8             // Bands this narrow (in bins) use Goertzel instead of a full FFT
+
+// Bands
+#define FULL_RANGE_MIN 20.0f    // Lower edge of the full range band in Hz
+#define FULL_RANGE_MAX 20000.0f // Upper edge of the full range band in Hz (clamped to Nyquist)
+#define BAND_CUBE               // Compute every third octave band each frame so switching bands is instant
 
 // Audio
 const char* AUDIO_DEVICE_NAME = "hw:1,0"; // arecord -l (type in console to find)
+const char* AGGREGATE_DEVICE_NAMES = "hw:1,0 hw:2,0 hw:3,0 hw:4,0"; // Interfaces of one array with ENABLE_AGGREGATE, the first is the clock master
+#define AGGREGATE_DEVICE_CHANNELS 16      // Channels of each aggregate device, hardware channel c is channel c % 16 of device c / 16
+#define DRIFT_BANDWIDTH 0.2f              // Hz, bandwidth of the per device clock filter (lower is smoother, slower to lock)
+#define DRIFT_SETTLE_FACTOR 8            // Bandwidth multiple for the first second after a device locks
+#define DRIFT_SLEW_BLOCKS 64              // Blocks over which an alignment error is resampled away
+#define ALIGN_RESET_FRAMES 32             // Alignment errors beyond this (a restarted device) jump instead of slewing
+#define AGGREGATE_MAX_WAIT_MS 20          // A device this late with a block is silent for that block
 #define SAMPLE_RATE 48000                 // Audio sample rate
 
+// Capture sample formats, best first (the device is asked for CAPTURE_FORMAT, then the rest in this order)
+enum sample_format: uint8_t
+{
+    SAMPLE_S32,   // S32_LE
+    SAMPLE_FLOAT, // FLOAT_LE
+    SAMPLE_S24,   // S24_LE, 24 bits in 4 bytes
+    SAMPLE_S24_3, // S24_3LE, packed 3 bytes
+    SAMPLE_S16,   // S16_LE, half the bus bandwidth of S32 on wide arrays
+    NUM_SAMPLE_FORMATS
+};
+#define CAPTURE_FORMAT SAMPLE_S32         // Sample format tried first
+#define CAPTURE_PERIOD 256                // Frames per capture block, also the period asked of the device (5.3 ms at 48 kHz), independent of FFT_SIZE
+#define CAPTURE_PERIODS 4                 // Periods in the ALSA buffer, headroom for the capture thread
+#define AUDIO_RING_MS 680                 // Audio kept between the capture thread and the beamformer (longest window is half of it)
+#define CAPTURE_RETRY_MS 500              // Wait between attempts to reopen a lost capture device
+
+// Real-time profile (see Realtime.h), every step falls back to normal scheduling when not permitted
+// #define REALTIME_PROFILE                 // SCHED_FIFO capture thread, CPU pinning and locked memory
+#define CAPTURE_PRIORITY 80                 // SCHED_FIFO priority of the capture thread (1-99)
+#define CAPTURE_CPU_MASK 0x8                // CPUs of the capture thread (bit i = CPU i, 0 = any), core 3 of a Pi
+#define DSP_CPU_MASK 0x7                    // CPUs of the beamform / render thread and its OpenMP and FFTW workers
+#define CAMERA_CPU_MASK 0x7                 // CPUs of the camera thread
+#define REALTIME_STACK_PREFAULT (256 * 1024) // Stack bytes the capture thread faults in before its first period
+
 // Camera
 #define FRAME_RATE 30         // Frame rate of the camera
 #define RESOLUTION_WIDTH 640  // Width of the camera
@@ -78,13 +159,22 @@ const char* AUDIO_DEVICE_NAME = "hw:1,0"; // arecord -l (type in console to find
 // FPS counter
 #define FPS_COUNTER_AVERAGE 10 // Number of frames to be averaged for calculating FPS
 
+// Frame budget
+#define TARGET_FPS 15.0f        // Frame rate the frame budget controller holds
+#define BUDGET_SMOOTHING 0.2f   // Exponential smoothing of frame and beamform times
+#define BUDGET_HYSTERESIS 0.15f // Step down above (1 + h) * budget, step up below (1 - h) * budget
+#define BUDGET_HOLD_FRAMES 10   // Frames a condition has to hold before changing level
+#define BUDGET_MIN_SHARE 0.25f  // Only degrade if beamforming takes at least this share of the frame
+#define BUDGET_PROBE_FACTOR 10  // Retry a level that did not fit after this many holds under budget
+
 // Post processing types
 enum post_processing: uint8_t
 {
     POST_dBFS,
     POST_dBZ,
     POST_dBA,
-    POST_dBC
+    POST_dBC,
+    NUM_POST_PROCESSING
 };
 
 enum int_configs: uint8_t
@@ -95,12 +185,25 @@ enum int_configs: uint8_t
     quality,
     octave_band_value,
     third_band_value,
+    weighting,
+    engine_value,
+    fft_size_value,
+    m_channels_value,
+    n_channels_value,
+    min_theta_value,
+    max_theta_value,
+    step_theta_value,
+    min_phi_value,
+    max_phi_value,
+    step_phi_value,
     NUM_INT_CONFIGS
 };
 
 enum float_configs: uint8_t
 {
     imgui_alpha,
+    mic_spacing_value,
+    air_temperature_value,
     NUM_FLOAT_CONFIGS
 };
 
@@ -124,6 +227,8 @@ enum bool_configs: uint8_t
 
     full_range,
     octave_bands,
+    frame_budget_state,
+    reconfigure_state,
     NUM_BOOL_CONFIGS
 };
 
@@ -132,6 +237,9 @@ enum string_configs: uint8_t
     heatmap,
     save_path,
     current_band,
+    operating_point_text,
+    reconfigure_text,
+    audio_stats_text,
     NUM_STRING_CONFIGS
 };
 
@@ -195,7 +303,6 @@ extern CONFIG configs;
 // #define PRINT_BEAMFORM
 // #define PRINT_FFT
 // #define PRINT_FFT_COLLAPSE
-// #define PRINT_POST_PROCESS
 // #define PRINT_OUTPUT
 #define ENABLE_AUDIO
 #define ENABLE_VIDEO
@@ -203,6 +310,7 @@ extern CONFIG configs;
 #define AVG_SAMPLES 10
 #define PI_HW // Set for usage on Pi
 #define ENABLE_ALSA
+// #define ENABLE_AGGREGATE // Capture AGGREGATE_DEVICE_NAMES as one array (with ENABLE_ALSA)
 // #define ENABLE_WAV
 // #define UBUNTU // Set for usage on ubuntu
 
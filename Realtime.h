@@ -0,0 +1,174 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <pthread.h>      // pthread_setschedparam, pthread_setaffinity_np
+#include <sched.h>        // cpu_set_t
+#include <sys/mman.h>     // mlockall, mlock
+#include <sys/resource.h> // getrlimit
+#include <unistd.h>       // sysconf, geteuid
+
+// Headers
+#include "PARAMS.h"
+
+using namespace std;
+
+/*
+    Optional real-time profile (REALTIME_PROFILE): the capture thread runs SCHED_FIFO on its
+    own CPU, the beamform / render and camera threads stay off that CPU, and memory is locked
+    so a page fault or swap-out never stalls a period. Each step needs a permission the
+    process may not have (CAP_SYS_NICE or an rtprio limit, CAP_IPC_LOCK or a memlock limit);
+    without it the step is skipped with a warning and the thread runs as before.
+*/
+
+// CPUs the process may run on (cgroups, taskset, fewer cores than a mask), the online CPUs if that cannot be read
+cpu_set_t processCPUs()
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+        {
+            CPU_SET(cpu, &cpus);
+        } // end cpu
+    }
+    return cpus;
+} // end processCPUs
+
+// Read before main, so a thread pinned earlier (and the threads it starts) does not narrow it for the next pinThread
+const cpu_set_t process_cpus = processCPUs();
+
+//=====================================================================================
+
+// Pins the calling thread to the CPUs in mask (bit i = CPU i, 0 = leave as is), false if none of them are usable
+bool pinThread(const char *name, const uint64_t mask)
+{
+    if (mask == 0)
+    {
+        return true;
+    }
+
+    // Checked against the process, not the calling thread, so capture can leave the CPUs main is pinned to
+    const cpu_set_t &allowed = process_cpus;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++)
+    {
+        if ((mask >> cpu) & 1 && CPU_ISSET(cpu, &allowed))
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    } // end cpu
+
+    if (CPU_COUNT(&cpus) == 0)
+    {
+        cerr << "Not pinning " << name << " thread: no CPU of mask 0x" << hex << mask << dec << " is available\n";
+        return false;
+    }
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0)
+    {
+        cerr << "Could not pin " << name << " thread: " << strerror(error) << "\n";
+        return false;
+    }
+
+    return true;
+} // end pinThread
+
+//=====================================================================================
+
+// CPUs the calling thread may run on (after pinThread, the ones it is pinned to)
+int allowedCPUs()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return 1;
+    }
+    return max(CPU_COUNT(&allowed), 1);
+} // end allowedCPUs
+
+//=====================================================================================
+
+// SCHED_FIFO at priority (1-99) for the calling thread, false if not permitted (stays SCHED_OTHER)
+bool setRealtimePriority(const char *name, const int priority)
+{
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = max(sched_get_priority_min(SCHED_FIFO), min(priority, sched_get_priority_max(SCHED_FIFO)));
+
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0)
+    {
+        cerr << "Could not run " << name << " thread real-time: " << strerror(error) << " (needs CAP_SYS_NICE or an rtprio limit in /etc/security/limits.conf)\n";
+        return false;
+    }
+
+    return true;
+} // end setRealtimePriority
+
+//=====================================================================================
+
+// Touches the stack the calling thread will use, so the first deep call does not page fault
+void prefaultStack()
+{
+    volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+    {
+        stack[i] = 0;
+    } // end i
+} // end prefaultStack
+
+//=====================================================================================
+
+// Locks every current and future page in RAM, false (nothing locked) if the memlock limit is too small for the whole process
+bool lockMemory()
+{
+    // With MCL_FUTURE every allocation beyond the limit would fail, so only lock everything when there is no limit
+    rlimit limit;
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    if (geteuid() != 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        cerr << "Not locking all memory: memlock limit is " << limit.rlim_cur / 1024 << " kB, locking capture buffers only\n";
+        return false;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        cerr << "Could not lock memory: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    return true;
+} // end lockMemory
+
+//=====================================================================================
+
+// Faults in every page of a buffer (keeping its contents) and locks it if the memlock limit allows
+bool lockRegion(const char *name, void *data, const size_t bytes)
+{
+    const long page = sysconf(_SC_PAGESIZE);
+    volatile uint8_t *pages = static_cast<volatile uint8_t *>(data);
+    for (size_t i = 0; i < bytes; i += page)
+    {
+        pages[i] = pages[i];
+    } // end i
+
+    if (mlock(data, bytes) != 0)
+    {
+        cerr << "Could not lock " << name << " (" << bytes / 1024 << " kB): " << strerror(errno) << "\n";
+        return false;
+    }
+
+    return true;
+} // end lockRegion
+
+//=====================================================================================
@@ -0,0 +1,271 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib> // aligned_alloc
+#include <cstring>
+#include <ctime>   // clock_gettime
+#include <algorithm>
+
+// Headers
+#include "PARAMS.h"
+#include "Realtime.h"
+
+using namespace std;
+
+// Monotonic clock in ns, the clock block timestamps are in
+int64_t monotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000LL + now.tv_nsec;
+} // end monotonicTime
+
+// Blocks of block_frames that hold AUDIO_RING_MS of audio
+int ringBlocks(const int block_frames, const int sample_rate)
+{
+    const int64_t frames = static_cast<int64_t>(AUDIO_RING_MS) * sample_rate / 1000;
+    return max<int64_t>((frames + block_frames - 1) / block_frames, 2);
+} // end ringBlocks
+
+// Order and capture time of one block
+struct block_info
+{
+    uint64_t sequence; // Blocks published before this one
+    int64_t timestamp; // Capture time of the first frame in ns (monotonicTime)
+};
+
+/*
+    Read only view of the newest blocks of an audio_ring, oldest first. Blocks are channel
+    planar: channel (m, n) of a block is block_frames floats at (m * columns + n) * block_frames.
+    Valid until audio_ring::release(), the producer does not write over held blocks.
+*/
+struct audio_view
+{
+    int num_blocks;   // Blocks in the view
+    int block_frames; // Frames per block
+    int rows;         // Mic layout, as the geometry
+    int columns;
+
+    const float *slots;          // First slot of the ring
+    const block_info *slot_info; // (slot)
+    int num_slots;               // Slots in the ring
+    int slot_size;               // Floats per slot
+    int first_slot;              // Slot of the oldest block in the view
+
+    // Samples of mic (m, n) in a block of the view (0 = oldest)
+    const float *channel(const int block, const int m, const int n) const;
+
+    // Order and capture time of a block of the view
+    const block_info &info(const int block) const;
+
+    // Frames in the view
+    int frames() const {return num_blocks * block_frames;}
+};
+
+const float *audio_view::channel(const int block, const int m, const int n) const
+{
+    const int slot = (first_slot + block) % num_slots;
+    return slots + static_cast<size_t>(slot) * slot_size + (m * columns + n) * block_frames;
+} // end channel
+
+const block_info &audio_view::info(const int block) const
+{
+    return slot_info[(first_slot + block) % num_slots];
+} // end info
+
+/*
+    Lock-free single producer / single consumer ring of preallocated, 64 byte aligned blocks
+    between the capture thread and the main loop. The producer fills writeBlock() and publishes
+    it with commitBlock(); the consumer takes a zero-copy view of the newest blocks with
+    acquire() and hands them back with release().
+
+    Nothing is copied or locked: write_sequence orders block data (release / acquire) and the
+    held_sequence / write_sequence pair is a store-then-load handshake on both sides (seq_cst),
+    so either the producer sees the blocks the consumer holds, or the consumer sees the block
+    the producer is writing and picks a newer range. If the producer would have to write over
+    a held block, the new block is dropped and counted in getOverruns() instead, so a view
+    never tears. With ringBlocks() that takes a stall of about AUDIO_RING_MS.
+*/
+class audio_ring
+{
+public:
+    // Constructor, num_blocks blocks of rows x columns channels by block_frames frames
+    audio_ring(const int num_blocks, const int rows, const int columns, const int block_frames);
+
+    // Frees the blocks
+    ~audio_ring();
+
+    // Producer: block to fill, nullptr if it is still held (the block is dropped and counted as an overrun)
+    float *writeBlock();
+
+    // Producer: publishes the block from writeBlock() with the capture time of its first frame
+    void commitBlock(const int64_t timestamp);
+
+    // Consumer: view of the newest count blocks (fewer until the ring fills), false if nothing was published yet
+    bool acquire(const int count, audio_view &view);
+
+    // Consumer: lets the producer reuse the blocks of the last view
+    void release();
+
+    // Frames per block
+    int getBlockFrames() const;
+
+    // Blocks published since start
+    uint64_t getWritten() const;
+
+    // Blocks dropped because the consumer held them
+    uint64_t getOverruns() const;
+
+    // Keeps every block in RAM (mlock), false if the memlock limit is too small
+    bool lock();
+
+private:
+    static const uint64_t NOT_HELD = UINT64_MAX;
+
+    int num_slots;    // Blocks in the ring
+    int rows;         // Mic layout
+    int columns;
+    int block_frames; // Frames per block
+    int slot_size;    // Floats per slot, padded to a cache line
+
+    float *slots;          // (slot, channel, frame)
+    block_info *slot_info; // (slot)
+    bool dropping;         // Producer: current block is dropped
+
+    alignas(64) atomic<uint64_t> write_sequence; // Blocks published, written by the producer only
+    alignas(64) atomic<uint64_t> held_sequence;  // Oldest block the consumer holds, written by the consumer only
+    alignas(64) atomic<uint64_t> overruns;       // Blocks dropped
+};
+
+audio_ring::audio_ring(const int num_blocks, const int rows, const int columns, const int block_frames) : num_slots(max(num_blocks, 2)),
+                                                                                                          rows(rows),
+                                                                                                          columns(columns),
+                                                                                                          block_frames(block_frames),
+                                                                                                          slot_size((rows * columns * block_frames + 15) & ~15),
+                                                                                                          dropping(false),
+                                                                                                          write_sequence(0),
+                                                                                                          held_sequence(NOT_HELD),
+                                                                                                          overruns(0)
+{
+    const size_t bytes = static_cast<size_t>(num_slots) * slot_size * sizeof(float);
+    slots = static_cast<float *>(aligned_alloc(64, bytes));
+    slot_info = new block_info[num_slots];
+
+    // Silence until the first blocks arrive
+    memset(slots, 0, bytes);
+    for (int slot = 0; slot < num_slots; slot++)
+    {
+        slot_info[slot] = {0, 0};
+    } // end slot
+}
+
+audio_ring::~audio_ring()
+{
+    free(slots);
+    delete[] slot_info;
+} // end ~audio_ring
+
+//=====================================================================================
+
+float *audio_ring::writeBlock()
+{
+    const uint64_t sequence = write_sequence.load(memory_order_relaxed);
+    const uint64_t held = held_sequence.load();
+
+    // The slot still has block sequence - num_slots, which the consumer may hold
+    if (held != NOT_HELD && sequence >= static_cast<uint64_t>(num_slots) && sequence - num_slots >= held)
+    {
+        dropping = true;
+        overruns.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    dropping = false;
+    return slots + static_cast<size_t>(sequence % num_slots) * slot_size;
+} // end writeBlock
+
+//=====================================================================================
+
+void audio_ring::commitBlock(const int64_t timestamp)
+{
+    if (dropping)
+    {
+        return;
+    }
+
+    const uint64_t sequence = write_sequence.load(memory_order_relaxed);
+    slot_info[sequence % num_slots] = {sequence, timestamp};
+    write_sequence.store(sequence + 1); // Publishes the block data and info
+} // end commitBlock
+
+//=====================================================================================
+
+bool audio_ring::acquire(const int count, audio_view &view)
+{
+    // One slot always stays free for the block being written
+    const uint64_t max_blocks = min<uint64_t>(max(count, 1), num_slots - 1);
+
+    while (true)
+    {
+        const uint64_t written = write_sequence.load();
+        if (written == 0)
+        {
+            return false;
+        }
+
+        const uint64_t first = written - min(written, max_blocks);
+        held_sequence.store(first);
+
+        // A block being written now overwrites block current - num_slots, pick a newer range if that is held
+        const uint64_t current = write_sequence.load();
+        if (current >= static_cast<uint64_t>(num_slots) && current - num_slots >= first)
+        {
+            continue;
+        }
+
+        view.num_blocks = written - first;
+        view.block_frames = block_frames;
+        view.rows = rows;
+        view.columns = columns;
+        view.slots = slots;
+        view.slot_info = slot_info;
+        view.num_slots = num_slots;
+        view.slot_size = slot_size;
+        view.first_slot = first % num_slots;
+        return true;
+    } // end retry
+} // end acquire
+
+//=====================================================================================
+
+void audio_ring::release()
+{
+    held_sequence.store(NOT_HELD);
+} // end release
+
+//=====================================================================================
+
+int audio_ring::getBlockFrames() const
+{
+    return block_frames;
+} // end getBlockFrames
+
+uint64_t audio_ring::getWritten() const
+{
+    return write_sequence.load(memory_order_relaxed);
+} // end getWritten
+
+uint64_t audio_ring::getOverruns() const
+{
+    return overruns.load(memory_order_relaxed);
+} // end getOverruns
+
+bool audio_ring::lock()
+{
+    return lockRegion("audio ring", slots, static_cast<size_t>(num_slots) * slot_size * sizeof(float));
+} // end lock
+
+//=====================================================================================
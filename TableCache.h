@@ -0,0 +1,296 @@
+#pragma once
+
+// Libraries
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>     // rename, remove
+#include <fstream>
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat, mkdir
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+
+// Headers
+#include "PARAMS.h"
+
+using namespace std;
+
+// Tables stored in a cache file
+enum cached_table: uint32_t
+{
+    TABLE_DELAY,    // delay_time (theta, phi, m, n) float
+    TABLE_STEERING, // steering_step (theta, phi, m, n) complex<float>
+    NUM_CACHED_TABLES
+};
+
+// FNV-1a 64 bit over size bytes, continuing from hash
+uint64_t fnv1a(const void *data, const size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    } // end i
+    return hash;
+} // end fnv1a
+
+/*
+    One file per key in TABLE_CACHE_DIR. The key is an FNV-1a hash of everything the tables
+    depend on, so a changed array, grid, rate, FFT size or speed of sound simply misses.
+    Layout: header, then one entry per table, then the table data (64 byte aligned). The header
+    holds a checksum of entries and data; a file with the wrong magic, version, key, size or
+    checksum is ignored and the caller recomputes. Files are written to a temporary name
+    and renamed, so a reader never sees a half written file.
+*/
+class table_cache
+{
+public:
+    // Constructor
+    table_cache(const uint64_t key);
+
+    // Unmaps the file
+    ~table_cache();
+
+    // Maps and checks the cache file for the key, false on a miss or a bad file
+    bool load();
+
+    // Copies a table out of the mapped file, false if missing or a different size
+    bool read(const uint32_t table, void *data, const size_t bytes);
+
+    // Queues a table for save() (data has to stay valid until then)
+    void add(const uint32_t table, const void *data, const size_t bytes);
+
+    // Writes every added table
+    bool save();
+
+private:
+    struct header
+    {
+        char magic[4];       // "BFTC"
+        uint32_t version;    // TABLE_CACHE_VERSION
+        uint64_t key;        // Hash the file was written for
+        uint64_t checksum;   // checksum() of everything after the header
+        uint64_t file_size;  // Total bytes
+        uint32_t num_tables; // Entries after the header
+        uint32_t reserved;
+    };
+
+    struct entry
+    {
+        uint32_t table;  // cached_table enum
+        uint32_t reserved;
+        uint64_t offset; // From the start of the file
+        uint64_t bytes;
+    };
+
+    // Cache file for the key
+    string filename();
+
+    // FNV-1a style hash over 8 byte words in 4 independent lanes (byte-wise FNV-1a is ~10x slower on 10 MB tables)
+    static uint64_t checksum(const uint8_t *data, const size_t size);
+
+    uint64_t key;
+
+    // Mapped file
+    const uint8_t *mapped;
+    size_t mapped_size;
+
+    // Tables queued for save()
+    vector<entry> pending;
+    vector<const void *> pending_data;
+};
+
+table_cache::table_cache(const uint64_t key) : key(key),
+                                               mapped(nullptr),
+                                               mapped_size(0)
+{
+}
+
+table_cache::~table_cache()
+{
+    if (mapped)
+    {
+        munmap(const_cast<uint8_t *>(mapped), mapped_size);
+    }
+} // end ~table_cache
+
+//=====================================================================================
+
+string table_cache::filename()
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+    return string(TABLE_CACHE_DIR) + "/tables_" + hex + ".bin";
+} // end filename
+
+//=====================================================================================
+
+uint64_t table_cache::checksum(const uint8_t *data, const size_t size)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t lanes[4] = {0xcbf29ce484222325ULL, 0xcbf29ce484222325ULL ^ 1, 0xcbf29ce484222325ULL ^ 2, 0xcbf29ce484222325ULL ^ 3};
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        uint64_t words[4];
+        memcpy(words, data + i, sizeof(words));
+        for (int lane = 0; lane < 4; lane++)
+        {
+            lanes[lane] = (lanes[lane] ^ words[lane]) * prime;
+        } // end lane
+    } // end i
+
+    // Remaining bytes, then fold the lanes together
+    uint64_t hash = fnv1a(data + i, size - i);
+    return fnv1a(lanes, sizeof(lanes), hash);
+} // end checksum
+
+//=====================================================================================
+
+bool table_cache::load()
+{
+    string name = filename();
+    int file = open(name.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return false; // Not cached yet
+    }
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(header)))
+    {
+        close(file);
+        cerr << "Ignoring table cache " << name << ": too small\n";
+        return false;
+    }
+
+    mapped_size = file_stat.st_size;
+    void *address = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (address == MAP_FAILED)
+    {
+        mapped_size = 0;
+        cerr << "Could not map table cache " << name << "\n";
+        return false;
+    }
+    mapped = static_cast<const uint8_t *>(address);
+
+    header file_header;
+    memcpy(&file_header, mapped, sizeof(header));
+    const size_t entries_end = sizeof(header) + static_cast<size_t>(file_header.num_tables) * sizeof(entry);
+
+    bool good = memcmp(file_header.magic, "BFTC", 4) == 0 &&
+                file_header.version == TABLE_CACHE_VERSION &&
+                file_header.key == key &&
+                file_header.file_size == mapped_size &&
+                file_header.num_tables <= NUM_CACHED_TABLES &&
+                entries_end <= mapped_size &&
+                checksum(mapped + sizeof(header), mapped_size - sizeof(header)) == file_header.checksum;
+
+    if (!good)
+    {
+        cerr << "Ignoring table cache " << name << ": version, key or checksum mismatch\n";
+        munmap(const_cast<uint8_t *>(mapped), mapped_size);
+        mapped = nullptr;
+        mapped_size = 0;
+        return false;
+    }
+
+    return true;
+} // end load
+
+//=====================================================================================
+
+bool table_cache::read(const uint32_t table, void *data, const size_t bytes)
+{
+    if (!mapped)
+    {
+        return false;
+    }
+
+    header file_header;
+    memcpy(&file_header, mapped, sizeof(header));
+
+    for (uint32_t i = 0; i < file_header.num_tables; i++)
+    {
+        entry table_entry;
+        memcpy(&table_entry, mapped + sizeof(header) + i * sizeof(entry), sizeof(entry));
+        if (table_entry.table != table)
+        {
+            continue;
+        }
+
+        if (table_entry.bytes != bytes || table_entry.offset + table_entry.bytes > mapped_size)
+        {
+            return false;
+        }
+
+        memcpy(data, mapped + table_entry.offset, bytes);
+        return true;
+    } // end i
+
+    return false;
+} // end read
+
+//=====================================================================================
+
+void table_cache::add(const uint32_t table, const void *data, const size_t bytes)
+{
+    entry table_entry = {table, 0, 0, bytes};
+    pending.push_back(table_entry);
+    pending_data.push_back(data);
+} // end add
+
+//=====================================================================================
+
+bool table_cache::save()
+{
+    // Offsets follow the entry list, 64 byte aligned
+    uint64_t offset = sizeof(header) + pending.size() * sizeof(entry);
+    for (entry &table_entry : pending)
+    {
+        offset = (offset + 63) & ~static_cast<uint64_t>(63);
+        table_entry.offset = offset;
+        offset += table_entry.bytes;
+    } // end table_entry
+
+    vector<uint8_t> file_data(offset, 0);
+    memcpy(file_data.data() + sizeof(header), pending.data(), pending.size() * sizeof(entry));
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        memcpy(file_data.data() + pending[i].offset, pending_data[i], pending[i].bytes);
+    } // end i
+
+    header file_header;
+    memcpy(file_header.magic, "BFTC", 4);
+    file_header.version = TABLE_CACHE_VERSION;
+    file_header.key = key;
+    file_header.file_size = file_data.size();
+    file_header.num_tables = pending.size();
+    file_header.reserved = 0;
+    file_header.checksum = checksum(file_data.data() + sizeof(header), file_data.size() - sizeof(header));
+    memcpy(file_data.data(), &file_header, sizeof(header));
+
+    // Write under a temporary name so a reader never maps a partial file
+    mkdir(TABLE_CACHE_DIR, 0755);
+    string name = filename();
+    string temporary = name + ".tmp" + to_string(getpid());
+    ofstream file(temporary, ios::binary);
+    file.write(reinterpret_cast<const char *>(file_data.data()), file_data.size());
+    file.close();
+    if (!file || rename(temporary.c_str(), name.c_str()) != 0)
+    {
+        cerr << "Could not write table cache " << name << "\n";
+        remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+} // end save
+
+//=====================================================================================
@@ -16,6 +16,7 @@
 #include "imgui/ImGuiFileDialog.h"
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
+#include "Realtime.h"
 
 // add this to try on pi to makefile:            sdl2-config --cflags
 
@@ -35,6 +36,9 @@ public:
 
     bool processFrame(Mat& data_input, int pcm_error);
 
+    // Shows the layer of a (band, theta, phi) third octave cube selected by third_band_value
+    bool processFrame(array3D<float>& band_cube, int pcm_error);
+
 
 private:
     // Gets frame from other thread
@@ -186,12 +190,26 @@ bool video::readConfig() {
     config["imgui_clamp_min"]       = to_string(-100);
     config["imgui_clamp_max"]       = to_string(0);
     config["imgui_alpha"]           = to_string(0.5);
-    config["quality"]               = to_string(2);
+    config["quality"]               = to_string(BEAMFORM_QUALITY);
     config["save_path"]             = "";
     config["full_range"]            = "true";
     config["octave_bands"]          = "false";
     config["octave_band_value"]       = to_string(1);
     config["third_band_value"]      = to_string(1);
+    config["weighting"]             = to_string(POST_dBFS);
+    config["engine_value"]          = to_string(BEAMFORM_ENGINE);
+    config["frame_budget_state"]    = "false";
+    config["fft_size_value"]        = to_string(FFT_SIZE);
+    config["m_channels_value"]      = to_string(M_AMOUNT);
+    config["n_channels_value"]      = to_string(N_AMOUNT);
+    config["mic_spacing_value"]     = to_string(MIC_SPACING);
+    config["air_temperature_value"] = to_string(AIR_TEMPERATURE);
+    config["min_theta_value"]       = to_string(MIN_THETA);
+    config["max_theta_value"]       = to_string(MAX_THETA);
+    config["step_theta_value"]      = to_string(STEP_THETA);
+    config["min_phi_value"]         = to_string(MIN_PHI);
+    config["max_phi_value"]         = to_string(MAX_PHI);
+    config["step_phi_value"]        = to_string(STEP_PHI);
 
         if (configfile) { //load current config
             cout << "Now loading current config" << endl;
@@ -246,8 +264,23 @@ bool video::readConfig() {
     configs.s(save_path)            = config["save_path"];
     configs.b(full_range)           = config["full_range"]          == "true";
     configs.b(octave_bands)         = config["octave_bands"]        == "true";
-    configs.i(octave_band_value)      = stoi(config["octave_band_value"]);
-    configs.i(third_band_value)     = stoi(config["third_band_value"]);
+    configs.i(octave_band_value)      = min(max(stoi(config["octave_band_value"]), 0), NUM_FULL_OCTAVE_BANDS - 1);
+    configs.i(third_band_value)     = min(max(stoi(config["third_band_value"]), 0), NUM_THIRD_OCTAVE_BANDS - 1);
+    configs.i(weighting)            = stoi(config["weighting"]);
+    configs.i(engine_value)         = min(max(stoi(config["engine_value"]), 0), NUM_BEAMFORM_ENGINES - 1);
+    configs.b(frame_budget_state)   = config["frame_budget_state"]  == "true";
+    configs.i(fft_size_value)       = stoi(config["fft_size_value"]);
+    configs.i(m_channels_value)     = stoi(config["m_channels_value"]);
+    configs.i(n_channels_value)     = stoi(config["n_channels_value"]);
+    configs.f(mic_spacing_value)    = stof(config["mic_spacing_value"]);
+    configs.f(air_temperature_value) = stof(config["air_temperature_value"]);
+    configs.i(min_theta_value)      = stoi(config["min_theta_value"]);
+    configs.i(max_theta_value)      = stoi(config["max_theta_value"]);
+    configs.i(step_theta_value)     = stoi(config["step_theta_value"]);
+    configs.i(min_phi_value)        = stoi(config["min_phi_value"]);
+    configs.i(max_phi_value)        = stoi(config["max_phi_value"]);
+    configs.i(step_phi_value)       = stoi(config["step_phi_value"]);
+    configs.b(reconfigure_state)    = false;
 
         return true;
      }
@@ -279,6 +312,20 @@ bool video::writeConfig() {
     config["octave_bands"]          = configs.b(octave_bands) ? "true" : "false";
     config["octave_band_value"]       = to_string(configs.i(octave_band_value));
     config["third_band_value"]      = to_string(configs.i(third_band_value)); 
+    config["weighting"]             = to_string(configs.i(weighting));
+    config["engine_value"]          = to_string(configs.i(engine_value));
+    config["frame_budget_state"]    = configs.b(frame_budget_state) ? "true" : "false";
+    config["fft_size_value"]        = to_string(configs.i(fft_size_value));
+    config["m_channels_value"]      = to_string(configs.i(m_channels_value));
+    config["n_channels_value"]      = to_string(configs.i(n_channels_value));
+    config["mic_spacing_value"]     = to_string(configs.f(mic_spacing_value));
+    config["air_temperature_value"] = to_string(configs.f(air_temperature_value));
+    config["min_theta_value"]       = to_string(configs.i(min_theta_value));
+    config["max_theta_value"]       = to_string(configs.i(max_theta_value));
+    config["step_theta_value"]      = to_string(configs.i(step_theta_value));
+    config["min_phi_value"]         = to_string(configs.i(min_phi_value));
+    config["max_phi_value"]         = to_string(configs.i(max_phi_value));
+    config["step_phi_value"]        = to_string(configs.i(step_phi_value));
 
     wrconfigfile.open("config.txt");
     if(!wrconfigfile) {cout << "ERROR OPENING CONFIG.TXT FOR WRITING" << endl; fatal_error_flag = true; return false;}
@@ -357,6 +404,10 @@ std::cout << "Frame height: " << cap.get(cv::CAP_PROP_FRAME_HEIGHT) << std::endl
 
 void video::captureVideo(VideoCapture& cap, atomic<bool>& is_running) 
 {
+    #ifdef REALTIME_PROFILE
+    pinThread("camera", CAMERA_CPU_MASK);
+    #endif
+
     while (is_running) 
     {
         camFPSTimer.start();
@@ -411,8 +462,8 @@ Mat video::createHeatmap(Mat& data_input, const float lower_limit, const float u
     }
     if(configs.b(static_state) == true) {
     
-    double st_height = NUM_PHI;
-    double st_width = NUM_THETA;
+    double st_height = data_input.cols; // Phi, follows the grid the beamformer was built with
+    double st_width = data_input.rows;  // Theta
     double st_max = 0;
     double st_min = -100;
 
@@ -914,8 +965,8 @@ bool video::renderIMGui(Mat &frame_in) {
         ImGui::SameLine();
         
         ImGui::BeginGroup();
-        ImGui::Text("Audio: --");
-        ImGui::Text("Beamform: --");
+        ImGui::Text("Audio: %s", configs.s(audio_stats_text).empty() ? "--" : configs.s(audio_stats_text).c_str());
+        ImGui::Text("Beamform: %s", configs.b(frame_budget_state) ? configs.s(operating_point_text).c_str() : "--");
         ImGui::EndGroup();
 
 
@@ -944,7 +995,7 @@ bool video::renderIMGui(Mat &frame_in) {
             ImGui::SameLine(0, column_width); // Add some space between columns
             ImGui::BeginGroup(); // Fourth Column: Alpha
             ImGui::Text("%s", configs.s(current_band).c_str());
-            ImGui::VSliderInt("##band1", ImVec2(slider_width, 425), &configs.i(octave_band_value), 0, NUM_FULL_OCTAVE_BANDS, "%d");
+            ImGui::VSliderInt("##band1", ImVec2(slider_width, 425), &configs.i(octave_band_value), 0, NUM_FULL_OCTAVE_BANDS - 1, "%d");
             switch (configs.i(octave_band_value)) 
 			{
 				// 63 Hz
@@ -1001,7 +1052,7 @@ bool video::renderIMGui(Mat &frame_in) {
             ImGui::SameLine(0, column_width); // Add some space between columns
             ImGui::BeginGroup(); // Fourth Column: Alpha
             ImGui::Text("%s", configs.s(current_band).c_str());
-            ImGui::VSliderInt("##band2", ImVec2(slider_width, 425), &configs.i(third_band_value), 0, NUM_THIRD_OCTAVE_BANDS, "%d");
+            ImGui::VSliderInt("##band2", ImVec2(slider_width, 425), &configs.i(third_band_value), 0, NUM_THIRD_OCTAVE_BANDS - 1, "%d");
             switch (configs.i(third_band_value)) 
             {
                 case THIRD_63:	
@@ -1073,6 +1124,11 @@ bool video::renderIMGui(Mat &frame_in) {
                 configs.s(current_band) = "1250 Hz";
                 break;
                 
+            // 1600 Hz
+            case THIRD_1600:	
+                configs.s(current_band) = "1600 Hz";
+                break;	
+        
             case THIRD_2000:	
                 configs.s(current_band) = "2000 Hz";
                 break;	
@@ -1149,7 +1205,8 @@ bool video::renderIMGui(Mat &frame_in) {
     ImGui::SetNextWindowSize(ImVec2(660, 50), ImGuiCond_Always);
     ImGui::Begin("Info", nullptr, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse);
         ImGui::BeginGroup();
-        ImGui::Text("Maximum: %.1f", magnitude_max);
+        const char* weighting_names[NUM_POST_PROCESSING] = {"dBFS", "dBZ", "dBA", "dBC"};
+        ImGui::Text("Maximum: %.1f %s", magnitude_max, (configs.i(weighting) < NUM_POST_PROCESSING) ? weighting_names[configs.i(weighting)] : "");
         ImGui::SameLine();
         if(configs.b(full_range) == true) {
             ImGui::Text("| Full Range");
@@ -1198,6 +1255,20 @@ bool video::renderIMGui(Mat &frame_in) {
         ImGui::Checkbox("Data Clamp", &configs.b(data_clamp_state));
         ImGui::Checkbox("Threshold", &configs.b(threshold_state));
         ImGui::Checkbox("AutoSave Config", &configs.b(auto_save_state));
+        ImGui::Checkbox("Frame Budget", &configs.b(frame_budget_state));
+
+        // Frequency weighting applied to the map
+        ImGui::RadioButton("dBFS", &configs.i(weighting), POST_dBFS);
+        ImGui::SameLine();
+        ImGui::RadioButton("dBZ", &configs.i(weighting), POST_dBZ);
+        ImGui::SameLine();
+        ImGui::RadioButton("dBA", &configs.i(weighting), POST_dBA);
+        ImGui::SameLine();
+        ImGui::RadioButton("dBC", &configs.i(weighting), POST_dBC);
+
+        // Beamforming engine, applied between frames (falls back to Frequency where the array does not allow it)
+        const char* engine_names[NUM_BEAMFORM_ENGINES] = {"Time Domain", "Frequency", "Spatial FFT", "Separable", "CSM"};
+        ImGui::Combo("Engine", &configs.i(engine_value), engine_names, NUM_BEAMFORM_ENGINES);
         
         if (configs.b(full_range) == true) {
             if(ImGui::Button("Full Range")) {
@@ -1223,6 +1294,28 @@ bool video::renderIMGui(Mat &frame_in) {
 
         
 
+        // Applied between frames by rescaling the delay tables, no rebuild
+        ImGui::SliderFloat("Air Temp (C)", &configs.f(air_temperature_value), -20.0f, 50.0f, "%.1f");
+
+        // Rebuilt in the background, the current map keeps running until the new one is ready
+        if (ImGui::CollapsingHeader("Beamformer")) {
+            ImGui::InputInt("FFT Size", &configs.i(fft_size_value), 256, 1024);
+            ImGui::InputInt("Mics M", &configs.i(m_channels_value));
+            ImGui::InputInt("Mics N", &configs.i(n_channels_value));
+            ImGui::InputFloat("Spacing (m)", &configs.f(mic_spacing_value), 0.001f, 0.01f, "%.3f");
+            ImGui::InputInt("Min Theta", &configs.i(min_theta_value));
+            ImGui::InputInt("Max Theta", &configs.i(max_theta_value));
+            ImGui::InputInt("Step Theta", &configs.i(step_theta_value));
+            ImGui::InputInt("Min Phi", &configs.i(min_phi_value));
+            ImGui::InputInt("Max Phi", &configs.i(max_phi_value));
+            ImGui::InputInt("Step Phi", &configs.i(step_phi_value));
+            if (ImGui::Button("Apply")) {
+                configs.b(reconfigure_state) = true;
+            }
+            ImGui::SameLine();
+            ImGui::Text("%s", configs.s(reconfigure_text).c_str());
+        }
+
         ImGui::Checkbox("Hidden Menu", &configs.b(hidden_menu));
 
         if (ImGui::Button("Select Save Directory")) {
@@ -1385,4 +1478,15 @@ bool video::processFrame(Mat& data_input, int pcm_error_in)
     //
 } // end processData
 
+//=====================================================================================
+
+bool video::processFrame(array3D<float>& band_cube, int pcm_error_in)
+{
+    int band = min(max(configs.i(third_band_value), 0), static_cast<int>(band_cube.dim_1) - 1);
+
+    // Wrap the selected layer, no copy
+    Mat data_input(band_cube.dim_2, band_cube.dim_3, CV_32FC1, &band_cube.at(band, 0, 0));
+    return processFrame(data_input, pcm_error_in);
+} // end processFrame
+
 //=====================================================================================S
\ No newline at end of file
@@ -0,0 +1,132 @@
+// Steering and frame time of the frequency domain and separable engines for 4x4, 8x8 and 16x16 arrays (make bench),
+// after checking the SIMD delay-and-sum kernel against the STK one on the same audio
+
+// Libraries
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+
+// Headers
+#include "PARAMS.h"
+#include "Beamform-finaltimedelay.h"
+
+using namespace std;
+
+CONFIG configs(NUM_INT_CONFIGS, NUM_FLOAT_CONFIGS, NUM_BOOL_CONFIGS, NUM_STRING_CONFIGS);
+
+const int BENCH_FRAMES = 50;     // Timed frames per engine
+const int BENCH_WARMUP = 5;      // Untimed frames first (caches, page faults)
+const int BENCH_LOWER_BIN = 19;  // Band processed every frame
+const int BENCH_UPPER_BIN = 24;
+
+// Fills every block of the ring with white noise
+void fillRing(audio_ring &ring, const int num_blocks, const int channels)
+{
+    for (int block = 0; block < num_blocks; block++)
+    {
+        float *data = ring.writeBlock();
+        for (int i = 0; i < channels * ring.getBlockFrames(); i++)
+        {
+            data[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+        } // end i
+        ring.commitBlock(monotonicTime());
+    } // end block
+} // end fillRing
+
+// Largest difference in dB between the time domain maps of the STK and SIMD kernels on the same view
+float compareKernels(const beamform_params &params, audio_ring &ring)
+{
+    cv::Mat maps[NUM_BEAMFORM_KERNELS];
+    audio_view view;
+
+    for (int kernel = 0; kernel < NUM_BEAMFORM_KERNELS; kernel++)
+    {
+        beamform beamformer(params);
+        beamformer.setup();
+        beamformer.setEngine(ENGINE_TIME_DOMAIN);
+        beamformer.setKernel(kernel);
+        beamformer.setQuality(3);
+
+        ring.acquire(beamformer.windowFrames() / ring.getBlockFrames(), view);
+        beamformer.processData(maps[kernel], BENCH_LOWER_BIN, BENCH_UPPER_BIN, POST_dBFS, view);
+        ring.release();
+        maps[kernel] = maps[kernel].clone(); // The map dies with the beamformer
+    } // end kernel
+
+    float max_difference = 0.0f;
+    for (int i = 0; i < maps[KERNEL_STK].rows * maps[KERNEL_STK].cols; i++)
+    {
+        max_difference = max(max_difference, fabsf(maps[KERNEL_STK].ptr<float>()[i] - maps[KERNEL_SIMD].ptr<float>()[i]));
+    } // end i
+
+    return max_difference;
+} // end compareKernels
+
+// Average times in ms
+struct bench_time
+{
+    double steering; // Steering stage
+    double frame;    // Whole processData call
+};
+
+// Times one engine over BENCH_FRAMES frames
+bench_time benchEngine(const beamform_params &params, const uint8_t engine_type, audio_ring &ring)
+{
+    beamform beamformer(params);
+    beamformer.setup();
+    beamformer.setEngine(engine_type);
+    beamformer.setQuality(3); // Every direction, so the engines do the same work
+
+    cv::Mat map;
+    audio_view view;
+    bench_time total = {0.0, 0.0};
+    for (int frame = 0; frame < BENCH_WARMUP + BENCH_FRAMES; frame++)
+    {
+        ring.acquire(beamformer.windowFrames() / ring.getBlockFrames(), view);
+        beamformer.processData(map, BENCH_LOWER_BIN, BENCH_UPPER_BIN, POST_dBFS, view);
+        ring.release();
+
+        if (frame >= BENCH_WARMUP)
+        {
+            total.steering += beamformer.getSteeringTime();
+            total.frame += beamformer.getProcessTime();
+        }
+    } // end frame
+
+    return {total.steering / BENCH_FRAMES, total.frame / BENCH_FRAMES};
+} // end benchEngine
+
+int main()
+{
+    cout << "Frequency domain -> separable engine, bins " << BENCH_LOWER_BIN << " to " << BENCH_UPPER_BIN << ", " << NUM_THETA << "x" << NUM_PHI << " grid, average of " << BENCH_FRAMES << " frames\n";
+    cout << fixed << setprecision(2);
+    bool kernels_match = true;
+
+    for (int size : {4, 8, 16})
+    {
+        geometry mics(size, size, MIC_SPACING);
+        beamform_params params = defaultBeamformParams(mics);
+
+        audio_ring ring(ringBlocks(CAPTURE_PERIOD, SAMPLE_RATE), size, size, CAPTURE_PERIOD);
+        fillRing(ring, ringBlocks(CAPTURE_PERIOD, SAMPLE_RATE), size * size);
+
+        const float kernel_difference = compareKernels(params, ring);
+        if (kernel_difference > KERNEL_TOLERANCE_DB)
+        {
+            cerr << size << "x" << size << ": SIMD kernel differs from STK by " << kernel_difference << " dB (tolerance " << KERNEL_TOLERANCE_DB << " dB)\n";
+            kernels_match = false;
+        }
+
+        const bench_time frequency_domain = benchEngine(params, ENGINE_FREQUENCY_DOMAIN, ring);
+        const bench_time separable = benchEngine(params, ENGINE_SEPARABLE, ring);
+
+        cout << setw(2) << size << "x" << setw(2) << left << size << right
+             << "  steering " << setw(6) << frequency_domain.steering << " -> " << setw(6) << separable.steering << " ms"
+             << " (" << setprecision(1) << frequency_domain.steering / separable.steering << "x)" << setprecision(2)
+             << "  frame " << setw(6) << frequency_domain.frame << " -> " << setw(6) << separable.frame << " ms"
+             << "  kernels " << scientific << setprecision(1) << kernel_difference << " dB" << fixed << setprecision(2) << "\n";
+    } // end size
+
+    return kernels_match ? 0 : 1;
+} // end main
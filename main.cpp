@@ -5,10 +5,17 @@
 #include <ctime>
 #include <chrono>
 #include <iomanip>
+#include <memory>
+#include <future>
+#include <omp.h>
 
 #include "PARAMS.h"
 #include "ALSA.h"
-#include "Beamform.h"
+#include "Aggregate.h"
+#include "Beamform-finaltimedelay.h"
+#include "Geometry.h"
+#include "Bands.h"
+#include "Budget.h"
 #include "Video.h"
 #include "Timer.h"
 #include "wav.h"
@@ -18,23 +25,88 @@ using namespace std;
 
 CONFIG configs(NUM_INT_CONFIGS, NUM_FLOAT_CONFIGS, NUM_BOOL_CONFIGS, NUM_STRING_CONFIGS);
 
+// Beamformer parameters from the Options menu, PARAMS.h for everything the UI does not set
+beamform_params configParams(const geometry &mics)
+{
+    beamform_params params = defaultBeamformParams(mics);
+    #ifdef ENABLE_VIDEO
+    params.fft_size = configs.i(fft_size_value);
+    params.m_channels = configs.i(m_channels_value);
+    params.n_channels = configs.i(n_channels_value);
+    if (string(GEOMETRY_FILE).empty())
+    {
+        params.mics = geometry(M_AMOUNT, N_AMOUNT, configs.f(mic_spacing_value)); // Spacing only applies to the lattice
+    }
+    params.speed_of_sound = speedOfSound(configs.f(air_temperature_value));
+    params.min_theta = configs.i(min_theta_value);
+    params.max_theta = configs.i(max_theta_value);
+    params.step_theta = configs.i(step_theta_value);
+    params.min_phi = configs.i(min_phi_value);
+    params.max_phi = configs.i(max_phi_value);
+    params.step_phi = configs.i(step_phi_value);
+    #endif
+    return params;
+} // end configParams
+
+// Builds and sets up a beamformer (delays, steering, windows, FFT plans), nullptr on failure
+unique_ptr<beamform> buildBeamform(const beamform_params params)
+{
+    try
+    {
+        unique_ptr<beamform> beamformer = make_unique<beamform>(params);
+        beamformer->setup();
+        return beamformer;
+    }
+    catch (const exception &error)
+    {
+        cerr << "Beamformer rebuild failed: " << error.what() << "\n";
+        return nullptr;
+    }
+} // end buildBeamform
+
 int main()
 {
 
     Mat frame;
 
+    // Lock memory and keep this thread (beamform and render) off the capture CPU, before any
+    // OpenMP or FFTW worker exists so they inherit the affinity. The team size OpenMP worked
+    // out at startup counts every core, so it is cut to the pinned ones (and with it the
+    // FFTW threads and wisdom file the beamformer picks)
+    #ifdef REALTIME_PROFILE
+    lockMemory();
+    if (pinThread("beamform", DSP_CPU_MASK))
+    {
+        omp_set_num_threads(allowedCPUs());
+    }
+    #endif
+
     //=====================================================================================
 
+    // Microphone positions and hardware channels
+    geometry mics(M_AMOUNT, N_AMOUNT, MIC_SPACING);
+    if (!string(GEOMETRY_FILE).empty() && !mics.load(GEOMETRY_FILE))
+    {
+        cerr << "Using the " << M_AMOUNT << "x" << N_AMOUNT << " lattice.\n";
+    }
+    mics.print();
+
     // Initialize ALSA and Beamform
     #ifdef ENABLE_AUDIO
     #ifdef ENABLE_ALSA
-    ALSA ALSA(AUDIO_DEVICE_NAME, M_AMOUNT, N_AMOUNT, SAMPLE_RATE, FFT_SIZE);
+    #ifdef ENABLE_AGGREGATE
+    aggregate ALSA(AGGREGATE_DEVICE_NAMES, mics, SAMPLE_RATE, CAPTURE_PERIOD);
+    #else
+    ALSA ALSA(AUDIO_DEVICE_NAME, mics, SAMPLE_RATE, CAPTURE_PERIOD);
     #endif
-    beamform beamform(FFT_SIZE, SAMPLE_RATE, M_AMOUNT, N_AMOUNT, NUM_TAPS,
-                      MIC_SPACING, 343.0f,
-                      MIN_THETA, MAX_THETA, STEP_THETA, NUM_THETA,
-                      MIN_PHI, MAX_PHI, STEP_PHI, NUM_PHI);
     #endif
+    #endif
+
+    // Beamformer in use, bands and band cube for its FFT size and grid, and a replacement being built
+    unique_ptr<beamform> beamformer;
+    unique_ptr<bands> band_table;
+    unique_ptr<array3D<float>> band_cube; // (band, theta, phi) dB
+    future<unique_ptr<beamform>> beamform_pending;
 
     // Initialize video
     #ifdef ENABLE_VIDEO
@@ -47,38 +119,29 @@ int main()
     // Timer for testing
     timer test("Test");
 
+    // Trades grid resolution and band width for frame rate
+    budget frame_budget(TARGET_FPS);
+
     // Arrays to store data
-    array3D<float> audio_data_buffer_1(M_AMOUNT, N_AMOUNT, FFT_SIZE);
-    array3D<float> audio_data_buffer_2(M_AMOUNT, N_AMOUNT, FFT_SIZE);
     cv::Mat processed_data(NUM_THETA, NUM_PHI, CV_32FC1, cv::Scalar(0));
 
-    // Clear buffers
-    for (int m = 0; m < audio_data_buffer_1.dim_1; m++)
-    {
-        for (int n = 0; n < audio_data_buffer_1.dim_2; n++)
-        {
-            for (int b = 0; b < audio_data_buffer_1.dim_3; b++)
-            {
-                audio_data_buffer_1.at(m, n, b) = 0.0f;
-                audio_data_buffer_2.at(m, n, b) = 0.0f;
-            } // end b
-        } // end n
-    } // end m
+    // Blocks the beamformer reads, from the capture thread or the WAV file
+    audio_ring* audio_source = nullptr;
 
     // Send configuration to ALSA and start recording audio
     #ifdef ENABLE_AUDIO
     #ifdef ENABLE_ALSA
     ALSA.setup();
     ALSA.start();
+    audio_source = &ALSA.getRing();
+    uint64_t logged_recoveries = 0; // Capture restarts already logged
     #endif
     // cout << "Audio setup complete.\n"; 
 
-    beamform.setup();
-    // cout << "Beamform setup complete.\n";
-
     #ifdef ENABLE_WAV
     WAV WAV;
     WAV.setup("test1k.wav");
+    audio_source = &WAV.getRing();
     #endif
     #endif
     // Start video capture
@@ -86,6 +149,30 @@ int main()
     video.startCapture();
     cout << "Video setup complete.\n";
     #endif
+
+    // Beamformer from the saved configuration (read by startCapture)
+    #ifdef ENABLE_AUDIO
+    beamform_params params = configParams(mics);
+    if (!params.valid())
+    {
+        cerr << "Using beamformer parameters from PARAMS.h.\n";
+        params = defaultBeamformParams(mics);
+        configs.i(m_channels_value) = params.m_channels;
+        configs.i(n_channels_value) = params.n_channels;
+    }
+    beamformer = buildBeamform(params);
+    if (!beamformer)
+    {
+        #ifdef ENABLE_ALSA
+        ALSA.stop();
+        #endif
+        return 1;
+    }
+    band_table = make_unique<bands>(params.fft_size, params.sample_rate);
+    band_table->setup();
+    band_cube = make_unique<array3D<float>>(NUM_THIRD_OCTAVE_BANDS, params.numTheta(), params.numPhi());
+    // cout << "Beamform setup complete.\n";
+    #endif
  
     //=====================================================================================
 
@@ -94,17 +181,92 @@ int main()
     {
         
         test.start();
-        // Copy data from ring buffer and process beamforming
+
         #ifdef ENABLE_AUDIO
-        #ifdef ENABLE_ALSA
-        ALSA.copyRingBuffer(audio_data_buffer_1, audio_data_buffer_2);
+        // Apply in Options starts a rebuild, capture and the current beamformer keep running meanwhile
+        if (configs.b(reconfigure_state))
+        {
+            configs.b(reconfigure_state) = false;
+            beamform_params new_params = configParams(mics);
+            if (beamform_pending.valid())
+            {
+                configs.s(reconfigure_text) = "Busy";
+            }
+            else if (!new_params.valid())
+            {
+                configs.s(reconfigure_text) = "Invalid";
+            }
+            else
+            {
+                beamform_pending = async(launch::async, buildBeamform, new_params);
+                configs.s(reconfigure_text) = "Building";
+            }
+        }
+
+        // Swap in the new beamformer between frames, the only place it is used
+        if (beamform_pending.valid() && beamform_pending.wait_for(chrono::seconds(0)) == future_status::ready)
+        {
+            unique_ptr<beamform> built = beamform_pending.get();
+            if (built)
+            {
+                const beamform_params &new_params = built->getParams();
+                band_table = make_unique<bands>(new_params.fft_size, new_params.sample_rate);
+                band_table->setup();
+                band_cube = make_unique<array3D<float>>(NUM_THIRD_OCTAVE_BANDS, new_params.numTheta(), new_params.numPhi());
+                processed_data = cv::Mat(new_params.numTheta(), new_params.numPhi(), CV_32FC1, cv::Scalar(0)); // Wrapped the old one's map
+                beamformer.swap(built); // Old one is freed here, at the end of this block
+                frame_budget.reset();   // Times were measured on the old one
+                configs.s(reconfigure_text) = "Applied";
+            }
+            else
+            {
+                configs.s(reconfigure_text) = "Failed";
+            }
+        }
+        #endif
+
+        // Frame budget picks the operating point, the Quality slider stays the ceiling
+        operating_point point = BUDGET_LADDER[0];
+        if (configs.b(frame_budget_state))
+        {
+            point = frame_budget.current();
+        }
+
+        // Third octave mode computes every band so the slider only picks a layer
+        bool show_band_cube = false;
+        #ifdef BAND_CUBE
+        show_band_cube = !configs.b(full_range) && !configs.b(octave_bands) && point.band_cube && band_cube != nullptr;
         #endif
-        // audio_data_buffer_1.print_layer(100);
+
+        // Process beamforming straight from the newest ring blocks
+        #ifdef ENABLE_AUDIO
         #ifdef ENABLE_WAV
-        WAV.readWAV(audio_data_buffer_1, audio_data_buffer_2);
+        WAV.readWAV();
         #endif
 
-        beamform.processData(processed_data, 19, 24, POST_dBFS, audio_data_buffer_1, audio_data_buffer_2);
+        #ifdef ENABLE_VIDEO
+        beamformer->setSpeedOfSound(speedOfSound(configs.f(air_temperature_value))); // Rescales only when it moved
+        beamformer->setEngine(configs.i(engine_value)); // Only a new choice is applied
+        #endif
+        beamformer->setQuality(min(configs.i(quality), point.quality));
+        beamformer->setMaxBandBins(point.max_band_bins);
+        beamformer->setCSMBlocks(point.csm_blocks);
+
+        // Held until processData is done, the capture thread keeps writing the other blocks
+        audio_view audio;
+        const int block_frames = audio_source ? audio_source->getBlockFrames() : 1;
+        if (audio_source && audio_source->acquire((beamformer->windowFrames() + block_frames - 1) / block_frames, audio))
+        {
+            if (show_band_cube)
+            {
+                beamformer->processData(*band_cube, *band_table, configs.i(weighting), audio);
+            }
+            else
+            {
+                beamformer->processData(processed_data, band_table->selected(), configs.i(weighting), audio);
+            }
+            audio_source->release();
+        }
         // cout << "End of processData\n";
 
         
@@ -112,19 +274,40 @@ int main()
         
         // Generate heatmap and ui then display the frame
         int pcm_error = 0;
-        #ifdef ENABLE_VIDEO
-        // if (waitKey(1) >= 0) break;
         #ifdef ENABLE_AUDIO
         #ifdef ENABLE_ALSA
-        int pcm_error = ALSA.pcm_error;
+        // Capture restarts by itself, the error window only shows while the device is lost
+        capture_stats audio_stats = ALSA.getStats();
+        if (audio_stats.recoveries != logged_recoveries)
+        {
+            cout << "Audio: " << ALSA.describeStats(true) << "\n";
+            logged_recoveries = audio_stats.recoveries;
+        }
+        configs.s(audio_stats_text) = ALSA.describeStats(false);
+        pcm_error = ALSA.pcm_error;
         #endif
         #endif
-        if (video.processFrame(processed_data, pcm_error) == false) break;
+        #ifdef ENABLE_VIDEO
+        // if (waitKey(1) >= 0) break;
+        bool frame_ok = show_band_cube ? video.processFrame(*band_cube, pcm_error) : video.processFrame(processed_data, pcm_error);
+        if (frame_ok == false) break;
         //if (waitKey(1) >= 0) break;
         #endif
 
         test.end();
 
+        #ifdef ENABLE_AUDIO
+        if (configs.b(frame_budget_state))
+        {
+            frame_budget.update(test.time(), beamformer->getProcessTime());
+            configs.s(operating_point_text) = frame_budget.describe();
+        }
+        else
+        {
+            frame_budget.reset();
+        }
+        #endif
+
         double time = test.time(false);
         double fps = 1 / time;
         // cout << "FPS: " << fps << "\n";
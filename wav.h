@@ -8,6 +8,7 @@
 #include "Timer.h"
 #include "PARAMS.h"
 #include "AudioFile.h"
+#include "RingBuffer.h"
 
 
 class WAV
@@ -23,7 +24,11 @@ public:
     bool setup(const char* file_name);
 
     // Writes data to wav file
-    void readWAV(array3D<float>& data_buffer_1, array3D<float>& data_buffer_2);
+    // Writes the next FFT_SIZE frames of the file to the ring as one block
+    void readWAV();
+
+    // Blocks read from the file
+    audio_ring& getRing();
 
 
 private:
@@ -40,11 +45,12 @@ int numChannels;
 
 
 int b_file;
+int64_t start_time;  // Timestamp of the first block
+int64_t frames_read; // Frames played since setup, the file's own clock for block timestamps
 
 array2D<int> channel_order;
 
-array3D<float> data_buffer_1;   // Buffer for audio data
-array3D<float> data_buffer_2;   // Buffer for audio data
+audio_ring ring;                // Blocks for the beamformer, like ALSA
 
 };
 
@@ -54,9 +60,10 @@ WAV::WAV() :    sampleRate(0),
                 lengthInSeconds(0.0),
                 numChannels(0),
                 b_file(0),
+                start_time(0),
+                frames_read(0),
                 channel_order(M_AMOUNT, N_AMOUNT), // Initialize array2D with dimensions
-                data_buffer_1(M_AMOUNT, N_AMOUNT, FFT_SIZE), // Initialize array3D with dimensions
-                data_buffer_2(M_AMOUNT, N_AMOUNT, FFT_SIZE),  // Initialize array3D with dimensions
+                ring(ringBlocks(FFT_SIZE, SAMPLE_RATE), M_AMOUNT, N_AMOUNT, FFT_SIZE),
                 WAV_timer("WAV") // Initialize timer with name
 {
 
@@ -124,56 +131,44 @@ bool WAV::setup(const char* file_name) {
     std::cout << "File matches camera configuration." << std::endl;
     
     WAV_timer.start(); // Start the timer
+    start_time = monotonicTime();
 
     return true;
 } // end setup
 
 //=====================================================================================
 
-void WAV::readWAV(array3D<float>& data_buffer_1, array3D<float>& data_buffer_2) {
+void WAV::readWAV() {
 
     //cout << "Reading Wav File..." << endl;
 
-    swap(data_buffer_1.data, data_buffer_2.data);
-
-    //cout << "Buffer swapped..." << endl;
+    const int frames = ring.getBlockFrames();
 
-    if((b_file * 1024) + data_buffer_2.dim_3 > numSamplesPerChannel)
+    if((b_file * frames) + frames > numSamplesPerChannel)
     {
         b_file = 0;
         cout << "Repeating Wav File..." << endl;
     }
 
-   // cout << "checked b_file..." << endl;
-   
-   // std::cout << "data_buffer_2 dimensions: " 
-        //   << data_buffer_2.dim_1 << " x " 
-        //   << data_buffer_2.dim_2 << " x " 
-        //   << data_buffer_2.dim_3 << std::endl;
-        //   data_buffer_2.at(0, 0, 0) = 5;
-   // cout << "data_buffer_2.at(0, 0, 0): " << data_buffer_2.at(0, 0, 0) << endl;
-
-   //cout << input_audio.samples[1][1] << endl;
-
-    for (int m = 0; m < data_buffer_2.dim_1; m++){
-        //cout << "m: " << m << endl;
-        for (int n = 0; n < data_buffer_2.dim_2; n++){
-            //cout << "n: " << n << endl;
-            for (int b = 0; b < data_buffer_2.dim_3; b++){
-                //cout << "b: " << b <<  " b_file: " << b_file << endl;
-                data_buffer_2.at(m, n, b) = input_audio.samples[channel_order.at(m, n)][b_file * 1024 + b];
-               // data_buffer_2.at(m, n, b) = input_audio.samples[2][30];
-                
-                //cout << "end for loops" << endl;
+    float* block = ring.writeBlock();
+    if (block)
+    {
+        for (int m = 0; m < M_AMOUNT; m++){
+            for (int n = 0; n < N_AMOUNT; n++){
+                for (int b = 0; b < frames; b++){
+                    block[(m * N_AMOUNT + n) * frames + b] = input_audio.samples[channel_order.at(m, n)][b_file * frames + b];
+                }
             }
-            
         }
     }
+    // Timestamps follow the file, one block per call, so consecutive blocks are contiguous in time
+    ring.commitBlock(start_time + frames_read * 1000000000LL / SAMPLE_RATE);
 
     b_file++;
+    frames_read += frames;
 
     WAV_timer.end(); // End the timer
-    if (WAV_timer.time() < data_buffer_2.dim_3 * 1000 / sampleRate)
+    if (WAV_timer.time() < frames * 1000 / sampleRate)
     {
         cout << "yurp, ur time travelin" << endl;
         // this_thread::sleep_for(chrono::seconds((WAV_timer.time() - data_buffer_2.dim_3 * 1 / (sampleRate / 1000))));
@@ -182,4 +177,10 @@ void WAV::readWAV(array3D<float>& data_buffer_1, array3D<float>& data_buffer_2)
     WAV_timer.start(); // Restart the timer
 
 
-}
\ No newline at end of file
+}
+//=====================================================================================
+
+audio_ring& WAV::getRing()
+{
+    return ring;
+} // end getRing